@@ -0,0 +1,146 @@
+#include "Channel.h"
+
+#include <sys/wait.h>
+#include <time.h>
+
+#define MIN_SIZE 8
+#define MAX_SIZE (1 << 20)
+#define PING_PONG_BYTES (32 << 20)
+#define STREAM_BYTES (64 << 20)
+#define MIN_ROUNDS 50
+#define MAX_ROUNDS 10000
+
+void usage(char* name)
+{
+    fprintf(stderr, "USAGE: %s [nonblock]\n", name);
+    fprintf(stderr, "Runs ping-pong latency and streaming throughput for every channel type\n");
+    fprintf(stderr, "and message sizes from %d B to %d B.\n", MIN_SIZE, MAX_SIZE);
+    fprintf(stderr, "nonblock - use non-blocking channels, retrying on EAGAIN\n");
+    exit(EXIT_FAILURE);
+}
+
+int rounds_for(int size, int bytes)
+{
+    int rounds = bytes / size;
+    if (rounds < MIN_ROUNDS)
+        return MIN_ROUNDS;
+    if (rounds > MAX_ROUNDS)
+        return MAX_ROUNDS;
+    return rounds;
+}
+
+void send_message(channel_t* ch, char* buf, int size)
+{
+    while (channel_send(ch, buf, size) < 0)
+    {
+        if (errno != EAGAIN)
+            ERR("channel_send");
+        sched_yield();
+    }
+}
+
+void recv_message(channel_t* ch, char* buf, int size)
+{
+    while (channel_recv(ch, buf, size) < 0)
+    {
+        if (errno != EAGAIN)
+            ERR("channel_recv");
+        sched_yield();
+    }
+}
+
+double seconds_since(struct timespec* start)
+{
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now))
+        ERR("clock_gettime");
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void echo_work(channel_t* ch, char* buf, int size)
+{
+    int rounds = rounds_for(size, PING_PONG_BYTES);
+    for (int i = 0; i < rounds; i++)
+    {
+        recv_message(ch, buf, size);
+        send_message(ch, buf, size);
+    }
+    rounds = rounds_for(size, STREAM_BYTES);
+    for (int i = 0; i < rounds; i++)
+        recv_message(ch, buf, size);
+    send_message(ch, buf, 1);
+}
+
+void bench(channel_type type, int size, int nonblock, char* buf)
+{
+    channel_t parent, child;
+    channel_open(type, &parent, &child);
+    channel_set_nonblock(&parent, nonblock);
+    channel_set_nonblock(&child, nonblock);
+
+    pid_t pid;
+    if ((pid = fork()) < 0)
+        ERR("fork");
+    if (pid == 0)
+    {
+        channel_close_unused(&parent);
+        echo_work(&child, buf, size);
+        channel_close(&child);
+        exit(EXIT_SUCCESS);
+    }
+    channel_close_unused(&child);
+
+    struct timespec start;
+    int rounds = rounds_for(size, PING_PONG_BYTES);
+    if (clock_gettime(CLOCK_MONOTONIC, &start))
+        ERR("clock_gettime");
+    for (int i = 0; i < rounds; i++)
+    {
+        send_message(&parent, buf, size);
+        recv_message(&parent, buf, size);
+    }
+    double latency = seconds_since(&start) / rounds / 2;
+
+    rounds = rounds_for(size, STREAM_BYTES);
+    if (clock_gettime(CLOCK_MONOTONIC, &start))
+        ERR("clock_gettime");
+    for (int i = 0; i < rounds; i++)
+        send_message(&parent, buf, size);
+    recv_message(&parent, buf, size);
+    double throughput = (double)rounds * size / seconds_since(&start);
+
+    printf("%-15s %8d %12.2f %12.1f\n", CHANNEL_NAMES[type], size, latency * 1e6, throughput / (1 << 20));
+    fflush(stdout);
+
+    if (TEMP_FAILURE_RETRY(waitpid(pid, NULL, 0)) < 0)
+        ERR("waitpid");
+    channel_close(&parent);
+}
+
+int main(int argc, char** argv)
+{
+    int nonblock = 0;
+    if (argc > 2)
+        usage(argv[0]);
+    if (argc == 2)
+    {
+        if (strcmp(argv[1], "nonblock"))
+            usage(argv[0]);
+        nonblock = 1;
+    }
+
+    char* buf = malloc(MAX_SIZE);
+    if (!buf)
+        ERR("malloc");
+    memset(buf, 'x', MAX_SIZE);
+
+    printf("%-15s %8s %12s %12s\n", "transport", "size", "latency[us]", "MB/s");
+    fflush(stdout);
+    for (int type = 0; type < CHANNEL_TYPES; type++)
+    {
+        for (int size = MIN_SIZE; size <= MAX_SIZE; size *= 2)
+            bench(type, size, nonblock, buf);
+    }
+    free(buf);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,517 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <mqueue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define ERR(source) (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE))
+
+#define MQ_CHUNK 8192          // default /proc/sys/fs/mqueue/msgsize_max
+#define MQ_MAX_MSG 10          // default /proc/sys/fs/mqueue/msg_max
+#define SEQPACKET_CHUNK 65536  // stays well below the default socket buffer
+#define SHM_RING_SIZE (1 << 20)
+#define CACHE_LINE 64
+
+/*
+ * One request/response channel API over every transport used in the labs.
+ * A message is a block of bytes up to UINT32_MAX long. Byte-stream transports
+ * send it as a 4-byte length followed by the payload, record transports
+ * (mqueues, seqpacket sockets) split it into chunks with the length in the first one.
+ *
+ * Errors while setting a channel up end the process through ERR, like in the labs.
+ * channel_send and channel_recv return -1 and set errno instead. In non-blocking
+ * mode they fail with EAGAIN when they cannot start right away. Once a message
+ * has been started it is always finished, so framing is never broken.
+ * When the other end is closed they fail with EPIPE, except on mqueues which
+ * outlive both ends. A message too big for the buffer is dropped as a whole
+ * and fails with EMSGSIZE.
+ */
+
+typedef enum
+{
+    CHANNEL_PIPE,
+    CHANNEL_MQ,
+    CHANNEL_SHM,
+    CHANNEL_UNIX_STREAM,
+    CHANNEL_UNIX_SEQPACKET,
+    CHANNEL_TCP,
+    CHANNEL_TYPES
+} channel_type;
+
+static const char* const CHANNEL_NAMES[] = {"pipe", "mq", "shm", "unix-stream", "unix-seqpacket", "tcp"};
+
+typedef struct
+{
+    uint64_t head;  // written only by the producer
+    char pad1[CACHE_LINE - sizeof(uint64_t)];
+    uint64_t tail;  // written only by the consumer
+    char pad2[CACHE_LINE - sizeof(uint64_t)];
+    int closed;  // set by channel_close of either end, the other one stops waiting
+    char pad3[CACHE_LINE - sizeof(int)];
+    char data[SHM_RING_SIZE];
+} shm_ring_t;
+
+typedef struct
+{
+    channel_type type;
+    int nonblock;
+    int rfd, wfd;  // pipes and sockets, the same descriptor for sockets
+    mqd_t rq, wq;
+    char rq_name[32], wq_name[32];
+    shm_ring_t *rring, *wring;  // both point into one mapping of two rings
+    shm_ring_t* rings;
+    char* chunk;  // bounce buffer for record transports
+} channel_t;
+
+void channel_close(channel_t* ch);
+
+ssize_t channel_write_all(int fd, const char* buf, size_t count)
+{
+    size_t len = 0;
+    while (len < count)
+    {
+        ssize_t c = TEMP_FAILURE_RETRY(write(fd, buf + len, count - len));
+        if (c < 0)
+            return c;
+        len += c;
+    }
+    return len;
+}
+
+ssize_t channel_read_all(int fd, char* buf, size_t count)
+{
+    size_t len = 0;
+    while (len < count)
+    {
+        ssize_t c = TEMP_FAILURE_RETRY(read(fd, buf + len, count - len));
+        if (c < 0)
+            return c;
+        if (c == 0)
+        {
+            errno = EPIPE;
+            return -1;
+        }
+        len += c;
+    }
+    return len;
+}
+
+// Reads and drops count bytes, so the stream is left at the length of the next message
+ssize_t channel_skip_all(int fd, size_t count)
+{
+    char buf[4096];
+    while (count > 0)
+    {
+        ssize_t c = channel_read_all(fd, buf, count < sizeof(buf) ? count : sizeof(buf));
+        if (c < 0)
+            return c;
+        count -= c;
+    }
+    return 0;
+}
+
+void channel_init(channel_t* ch, channel_type type)
+{
+    memset(ch, 0, sizeof(channel_t));
+    ch->type = type;
+    ch->rfd = ch->wfd = -1;
+    ch->rq = ch->wq = (mqd_t)-1;
+}
+
+void channel_open_mq(channel_t* a, channel_t* b)
+{
+    static int counter = 0;
+    struct mq_attr attr = {};
+    attr.mq_maxmsg = MQ_MAX_MSG;
+    attr.mq_msgsize = MQ_CHUNK;
+
+    snprintf(a->wq_name, sizeof(a->wq_name), "/channel_%d_%d", getpid(), counter++);
+    snprintf(b->wq_name, sizeof(b->wq_name), "/channel_%d_%d", getpid(), counter++);
+    strcpy(a->rq_name, b->wq_name);
+    strcpy(b->rq_name, a->wq_name);
+    if ((a->wq = mq_open(a->wq_name, O_RDWR | O_CREAT | O_EXCL, 0600, &attr)) == (mqd_t)-1)
+        ERR("mq_open");
+    if ((b->wq = mq_open(b->wq_name, O_RDWR | O_CREAT | O_EXCL, 0600, &attr)) == (mqd_t)-1)
+        ERR("mq_open");
+    if ((a->rq = mq_open(a->rq_name, O_RDWR)) == (mqd_t)-1)
+        ERR("mq_open");
+    if ((b->rq = mq_open(b->rq_name, O_RDWR)) == (mqd_t)-1)
+        ERR("mq_open");
+}
+
+void channel_open_tcp(channel_t* a, channel_t* b)
+{
+    struct sockaddr_in addr = {};
+    socklen_t len = sizeof(addr);
+    int listenfd, t = 1;
+
+    if ((listenfd = socket(PF_INET, SOCK_STREAM, 0)) < 0)
+        ERR("socket");
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;  // let the kernel pick a free port
+    if (bind(listenfd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+        ERR("bind");
+    if (listen(listenfd, 1) < 0)
+        ERR("listen");
+    if (getsockname(listenfd, (struct sockaddr*)&addr, &len) < 0)
+        ERR("getsockname");
+    if ((a->rfd = socket(PF_INET, SOCK_STREAM, 0)) < 0)
+        ERR("socket");
+    if (connect(a->rfd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+        ERR("connect");
+    if ((b->rfd = TEMP_FAILURE_RETRY(accept(listenfd, NULL, NULL))) < 0)
+        ERR("accept");
+    if (setsockopt(a->rfd, IPPROTO_TCP, TCP_NODELAY, &t, sizeof(t)) || setsockopt(b->rfd, IPPROTO_TCP, TCP_NODELAY, &t, sizeof(t)))
+        ERR("setsockopt");
+    a->wfd = a->rfd;
+    b->wfd = b->rfd;
+    if (TEMP_FAILURE_RETRY(close(listenfd)) < 0)
+        ERR("close");
+}
+
+/**
+ * Opens both ends of a channel. Call it before fork and give one end to each process,
+ * the other end should then be closed with channel_close_unused.
+ */
+void channel_open(channel_type type, channel_t* a, channel_t* b)
+{
+    int fds[2], fds2[2];
+    channel_init(a, type);
+    channel_init(b, type);
+
+    switch (type)
+    {
+        case CHANNEL_PIPE:
+            if (pipe(fds) || pipe(fds2))
+                ERR("pipe");
+            a->rfd = fds[0];
+            b->wfd = fds[1];
+            b->rfd = fds2[0];
+            a->wfd = fds2[1];
+            break;
+        case CHANNEL_MQ:
+            channel_open_mq(a, b);
+            break;
+        case CHANNEL_SHM:
+            if ((a->rings = mmap(NULL, 2 * sizeof(shm_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) ==
+                MAP_FAILED)
+                ERR("mmap");
+            b->rings = a->rings;
+            a->wring = b->rring = &a->rings[0];
+            b->wring = a->rring = &a->rings[1];
+            break;
+        case CHANNEL_UNIX_STREAM:
+        case CHANNEL_UNIX_SEQPACKET:
+            if (socketpair(AF_UNIX, type == CHANNEL_UNIX_STREAM ? SOCK_STREAM : SOCK_SEQPACKET, 0, fds))
+                ERR("socketpair");
+            a->rfd = a->wfd = fds[0];
+            b->rfd = b->wfd = fds[1];
+            break;
+        case CHANNEL_TCP:
+            channel_open_tcp(a, b);
+            break;
+        default:
+            errno = EINVAL;
+            ERR("channel_open");
+    }
+    if (type == CHANNEL_MQ || type == CHANNEL_UNIX_SEQPACKET)
+    {
+        size_t size = type == CHANNEL_MQ ? MQ_CHUNK : SEQPACKET_CHUNK;
+        if (!(a->chunk = malloc(size)) || !(b->chunk = malloc(size)))
+            ERR("malloc");
+    }
+}
+
+void channel_set_nonblock(channel_t* ch, int nonblock) { ch->nonblock = nonblock; }
+
+/**
+ * Checks if the channel can start a send (events = POLLOUT) or receive (POLLIN) without waiting.
+ */
+int channel_ready(channel_t* ch, short events)
+{
+    struct mq_attr attr;
+    shm_ring_t* ring;
+    switch (ch->type)
+    {
+        case CHANNEL_MQ:
+            if (mq_getattr(events == POLLIN ? ch->rq : ch->wq, &attr))
+                ERR("mq_getattr");
+            return events == POLLIN ? attr.mq_curmsgs > 0 : attr.mq_curmsgs < attr.mq_maxmsg;
+        case CHANNEL_SHM:
+            ring = events == POLLIN ? ch->rring : ch->wring;
+            if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE))
+                return 1;  // like POLLHUP, the call does not wait and reports EPIPE
+            if (events == POLLIN)
+                return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail;
+            return ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) < SHM_RING_SIZE;
+        default:
+        {
+            struct pollfd pfd = {events == POLLIN ? ch->rfd : ch->wfd, events, 0};
+            int ret = TEMP_FAILURE_RETRY(poll(&pfd, 1, 0));
+            if (ret < 0)
+                ERR("poll");
+            return ret > 0;
+        }
+    }
+}
+
+/**
+ * Copies count bytes into the ring, waiting for the consumer to make room.
+ * @return 0, -1 with errno EPIPE if the ring is closed.
+ */
+int shm_ring_write(shm_ring_t* ring, const char* buf, size_t count)
+{
+    uint64_t head = ring->head;
+    while (count > 0)
+    {
+        uint64_t free_space;
+        while (1)
+        {
+            if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE))
+            {
+                errno = EPIPE;
+                return -1;
+            }
+            if ((free_space = SHM_RING_SIZE - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))) > 0)
+                break;
+            sched_yield();
+        }
+        size_t offset = head % SHM_RING_SIZE;
+        size_t len = count;
+        if (len > free_space)
+            len = free_space;
+        if (len > SHM_RING_SIZE - offset)
+            len = SHM_RING_SIZE - offset;
+        memcpy(ring->data + offset, buf, len);
+        head += len;
+        buf += len;
+        count -= len;
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/**
+ * Copies count bytes out of the ring into buf, or drops them if buf is NULL.
+ * Data written before the ring was closed is still read.
+ * @return 0, -1 with errno EPIPE if the ring is closed and empty.
+ */
+int shm_ring_read(shm_ring_t* ring, char* buf, size_t count)
+{
+    uint64_t tail = ring->tail;
+    while (count > 0)
+    {
+        uint64_t available;
+        while ((available = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail) == 0)
+        {
+            // closed is set after the last head update, so a second look at head finds all that was sent
+            if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE) && __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+            {
+                errno = EPIPE;
+                return -1;
+            }
+            sched_yield();
+        }
+        size_t offset = tail % SHM_RING_SIZE;
+        size_t len = count;
+        if (len > available)
+            len = available;
+        if (len > SHM_RING_SIZE - offset)
+            len = SHM_RING_SIZE - offset;
+        if (buf)
+        {
+            memcpy(buf, ring->data + offset, len);
+            buf += len;
+        }
+        tail += len;
+        count -= len;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+ssize_t channel_send_chunk(channel_t* ch, const char* buf, size_t len)
+{
+    if (ch->type == CHANNEL_MQ)
+        return TEMP_FAILURE_RETRY(mq_send(ch->wq, buf, len, 0));
+    return TEMP_FAILURE_RETRY(send(ch->wfd, buf, len, 0));
+}
+
+ssize_t channel_recv_chunk(channel_t* ch)
+{
+    if (ch->type == CHANNEL_MQ)
+        return TEMP_FAILURE_RETRY(mq_receive(ch->rq, ch->chunk, MQ_CHUNK, NULL));
+    ssize_t len = TEMP_FAILURE_RETRY(recv(ch->rfd, ch->chunk, SEQPACKET_CHUNK, 0));
+    if (len == 0)
+    {
+        errno = EPIPE;
+        return -1;
+    }
+    return len;
+}
+
+ssize_t channel_send_chunked(channel_t* ch, const char* buf, uint32_t len)
+{
+    size_t chunk_size = ch->type == CHANNEL_MQ ? MQ_CHUNK : SEQPACKET_CHUNK;
+    size_t first = len < chunk_size - sizeof(uint32_t) ? len : chunk_size - sizeof(uint32_t);
+
+    memcpy(ch->chunk, &len, sizeof(uint32_t));
+    memcpy(ch->chunk + sizeof(uint32_t), buf, first);
+    if (channel_send_chunk(ch, ch->chunk, first + sizeof(uint32_t)) < 0)
+        return -1;
+    for (size_t sent = first; sent < len; sent += chunk_size)
+    {
+        size_t part = len - sent < chunk_size ? len - sent : chunk_size;
+        if (channel_send_chunk(ch, buf + sent, part) < 0)
+            return -1;
+    }
+    return len;
+}
+
+ssize_t channel_recv_chunked(channel_t* ch, char* buf, size_t size)
+{
+    ssize_t got;
+    uint32_t len;
+
+    if ((got = channel_recv_chunk(ch)) < 0)
+        return -1;
+    memcpy(&len, ch->chunk, sizeof(uint32_t));
+    size_t received = got - sizeof(uint32_t);
+    if (len <= size)
+        memcpy(buf, ch->chunk + sizeof(uint32_t), received);
+    while (received < len)
+    {
+        if ((got = channel_recv_chunk(ch)) < 0)
+            return -1;
+        if (len <= size)
+            memcpy(buf + received, ch->chunk, got);
+        received += got;
+    }
+    if (len > size)  // the rest of the message was received and dropped
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return len;
+}
+
+/**
+ * Sends one message.
+ * @return len on success, -1 with errno set on failure.
+ */
+ssize_t channel_send(channel_t* ch, const void* buf, uint32_t len)
+{
+    if (ch->nonblock && !channel_ready(ch, POLLOUT))
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    switch (ch->type)
+    {
+        case CHANNEL_MQ:
+        case CHANNEL_UNIX_SEQPACKET:
+            return channel_send_chunked(ch, buf, len);
+        case CHANNEL_SHM:
+            if (shm_ring_write(ch->wring, (char*)&len, sizeof(uint32_t)) < 0 || shm_ring_write(ch->wring, buf, len) < 0)
+                return -1;
+            return len;
+        default:
+            if (channel_write_all(ch->wfd, (char*)&len, sizeof(uint32_t)) < 0 || channel_write_all(ch->wfd, buf, len) < 0)
+                return -1;
+            return len;
+    }
+}
+
+/**
+ * Receives one message into buf of the given size.
+ * @return Length of the message, -1 with errno set on failure (EMSGSIZE if it does not fit).
+ */
+ssize_t channel_recv(channel_t* ch, void* buf, size_t size)
+{
+    uint32_t len;
+    if (ch->nonblock && !channel_ready(ch, POLLIN))
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    switch (ch->type)
+    {
+        case CHANNEL_MQ:
+        case CHANNEL_UNIX_SEQPACKET:
+            return channel_recv_chunked(ch, buf, size);
+        case CHANNEL_SHM:
+            if (shm_ring_read(ch->rring, (char*)&len, sizeof(uint32_t)) < 0)
+                return -1;
+            if (len > size)
+            {
+                if (shm_ring_read(ch->rring, NULL, len) < 0)
+                    return -1;
+                errno = EMSGSIZE;
+                return -1;
+            }
+            if (shm_ring_read(ch->rring, buf, len) < 0)
+                return -1;
+            return len;
+        default:
+            if (channel_read_all(ch->rfd, (char*)&len, sizeof(uint32_t)) < 0)
+                return -1;
+            if (len > size)
+            {
+                if (channel_skip_all(ch->rfd, len) < 0)
+                    return -1;
+                errno = EMSGSIZE;
+                return -1;
+            }
+            if (channel_read_all(ch->rfd, buf, len) < 0)
+                return -1;
+            return len;
+    }
+}
+
+/**
+ * Closes the end of a channel that the other process uses, after fork.
+ * Unlike channel_close it keeps the shared ring mapping and the queue names.
+ */
+void channel_close_unused(channel_t* ch)
+{
+    ch->rings = NULL;
+    ch->wq_name[0] = '\0';
+    channel_close(ch);
+}
+
+void channel_close(channel_t* ch)
+{
+    if (ch->rfd >= 0 && TEMP_FAILURE_RETRY(close(ch->rfd)) < 0)
+        ERR("close");
+    if (ch->wfd >= 0 && ch->wfd != ch->rfd && TEMP_FAILURE_RETRY(close(ch->wfd)) < 0)
+        ERR("close");
+    if (ch->rq != (mqd_t)-1 && mq_close(ch->rq))
+        ERR("mq_close");
+    if (ch->wq != (mqd_t)-1 && mq_close(ch->wq))
+        ERR("mq_close");
+    if (ch->wq_name[0] && mq_unlink(ch->wq_name) && errno != ENOENT)
+        ERR("mq_unlink");
+    if (ch->rings)
+    {
+        // the peer may be waiting on either ring, closing both makes it fail with EPIPE instead
+        __atomic_store_n(&ch->rring->closed, 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&ch->wring->closed, 1, __ATOMIC_RELEASE);
+        if (munmap(ch->rings, 2 * sizeof(shm_ring_t)))
+            ERR("munmap");
+    }
+    free(ch->chunk);
+    channel_init(ch, ch->type);
+}
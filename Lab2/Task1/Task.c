@@ -1,10 +1,12 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <mqueue.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
@@ -12,12 +14,47 @@
 #define ERR(source)  (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
 #define MAX_NUM 10
 #define LIFE_SPAN 10
+#define MAX_PLAYERS 99
+#define DRAW_RING 64 //how many draws the parent may run ahead of the slowest player
+#define BATCH_SIZE 32
+#define CACHE_LINE 64
+
+typedef struct
+{
+    uint32_t seq; //odd while the parent is writing the slot
+    uint32_t num;
+    uint64_t index;
+}draw_slot;
+
+typedef struct
+{
+    uint64_t next; //index of the next draw the player wants, UINT64_MAX once it left
+    char pad[CACHE_LINE - sizeof(uint64_t)];
+}player_cursor;
+
+typedef struct
+{
+    draw_slot slots[DRAW_RING];
+    uint64_t total; //number of draws in the game, UINT64_MAX while it is still going
+    player_cursor cursors[MAX_PLAYERS] __attribute__((aligned(CACHE_LINE)));
+}draw_board;
+
+typedef struct
+{
+    uint8_t player;
+    uint8_t bingo;
+    uint8_t last;
+    uint8_t count;
+    uint64_t draws[BATCH_SIZE];
+}result_batch;
 
 volatile sig_atomic_t children_left = 0;
 
 void usage(char* pname)
 {
-    fprintf(stderr, "USAGE:%s\n", pname);
+    fprintf(stderr, "USAGE:%s n [draws]\n", pname);
+    fprintf(stderr, "n - number of players, 0 < n < 100\n");
+    fprintf(stderr, "draws - run the high-rate game publishing that many draws through shared memory\n");
     exit(EXIT_FAILURE);
 }
 
@@ -150,13 +187,231 @@ void parent_work(mqd_t pout)
     printf("Parent terminates\n");
 }
 
+
+void publish_draw(draw_board* board, uint64_t index, uint8_t num)
+{
+    draw_slot* slot = &board->slots[index % DRAW_RING];
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->num, num, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->index, index, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Reads the draw with the given index without taking any lock.
+ * @return 1 and the number in *num if the draw is published, 0 if it is not there yet.
+ */
+int read_draw(draw_board* board, uint64_t index, uint8_t* num)
+{
+    draw_slot* slot = &board->slots[index % DRAW_RING];
+    while(1)
+    {
+        uint32_t seq1 = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if(seq1 & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        uint64_t slot_index = __atomic_load_n(&slot->index, __ATOMIC_RELAXED);
+        uint32_t slot_num = __atomic_load_n(&slot->num, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq1)
+            continue;
+        if(seq1 == 0 || slot_index != index)
+            return 0;
+        *num = (uint8_t)slot_num;
+        return 1;
+    }
+}
+
+void send_batch(mqd_t pin, result_batch* batch)
+{
+    if(TEMP_FAILURE_RETRY(mq_send(pin, (char*)batch, sizeof(result_batch), 0))!=0)
+        ERR("mq_send");
+    batch->count = 0;
+}
+
+void child_work_fast(int n, draw_board* board, mqd_t pin)
+{
+    srand(getpid());
+    result_batch batch = {};
+    batch.player = n;
+    batch.bingo = (uint8_t)(rand()%MAX_NUM);
+    uint64_t* next = &board->cursors[n].next;
+    uint8_t num;
+
+    for(uint64_t i = 0;; i++)
+    {
+        int published;
+        while(!(published = read_draw(board, i, &num)) && i < __atomic_load_n(&board->total, __ATOMIC_ACQUIRE))
+            sched_yield();
+        if(!published)
+            break;
+        __atomic_store_n(next, i + 1, __ATOMIC_RELEASE);
+        if(num == batch.bingo)
+        {
+            batch.draws[batch.count++] = i;
+            if(batch.count == BATCH_SIZE)
+                send_batch(pin, &batch);
+        }
+    }
+    __atomic_store_n(next, UINT64_MAX, __ATOMIC_RELEASE);
+    batch.last = 1;
+    send_batch(pin, &batch);
+}
+
+void create_children_fast(int n, draw_board* board, mqd_t pin)
+{
+    while(n--)
+    {
+        switch(fork())
+        {
+            case 0:
+                child_work_fast(n, board, pin);
+                exit(EXIT_SUCCESS);
+            case -1:
+                ERR("fork");
+        }
+        children_left++;
+    }
+}
+
+/**
+ * Takes every result batch that is already waiting in the queue.
+ * @return Number of players that sent their last batch.
+ */
+int drain_results(mqd_t pin, uint64_t* hits, uint8_t* bingo)
+{
+    result_batch batch;
+    int finished = 0;
+    while(1)
+    {
+        if(mq_receive(pin, (char*)&batch, sizeof(result_batch), NULL) < 0)
+        {
+            if(errno == EAGAIN)
+                break;
+            if(errno == EINTR)
+                continue;
+            ERR("mq_receive");
+        }
+        hits[batch.player] += batch.count;
+        bingo[batch.player] = batch.bingo;
+        if(batch.last)
+            finished++;
+    }
+    return finished;
+}
+
+uint64_t slowest_player(draw_board* board, int n)
+{
+    uint64_t min = UINT64_MAX;
+    for(int i = 0; i<n;i++)
+    {
+        uint64_t next = __atomic_load_n(&board->cursors[i].next, __ATOMIC_ACQUIRE);
+        if(next < min)
+            min = next;
+    }
+    return min;
+}
+
+void parent_work_fast(int n, uint64_t draws, draw_board* board, mqd_t pin)
+{
+    uint64_t drawn[MAX_NUM] = {};
+    uint64_t hits[MAX_PLAYERS] = {};
+    uint8_t bingo[MAX_PLAYERS] = {};
+    int finished = 0;
+    uint64_t slowest = 0;
+    struct timespec start, end;
+
+    if(clock_gettime(CLOCK_MONOTONIC, &start))
+        ERR("clock_gettime");
+    for(uint64_t i = 0; i<draws;i++)
+    {
+        while(i - slowest >= DRAW_RING && slowest != UINT64_MAX)
+        {
+            if((slowest = slowest_player(board, n)) > i - DRAW_RING)
+                break;
+            finished += drain_results(pin, hits, bingo);
+            sched_yield();
+        }
+        uint8_t num = (uint8_t)(rand()%MAX_NUM);
+        drawn[num]++;
+        publish_draw(board, i, num);
+        if(i % 1024 == 0)
+            finished += drain_results(pin, hits, bingo);
+    }
+    __atomic_store_n(&board->total, draws, __ATOMIC_RELEASE);
+    while(finished < n)
+    {
+        finished += drain_results(pin, hits, bingo);
+        sched_yield();
+    }
+    if(clock_gettime(CLOCK_MONOTONIC, &end))
+        ERR("clock_gettime");
+
+    int missed = 0;
+    for(int i = 0; i<n;i++)
+    {
+        if(hits[i] != drawn[bingo[i]])
+            missed++;
+    }
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%lu draws broadcast to %d players in %.3f s: %.0f draws/s\n", draws, n, elapsed, draws / elapsed);
+    if(missed)
+        printf("%d players missed some of their Bingo numbers\n", missed);
+    else
+        printf("Every player saw every draw\n");
+}
+
+int main_fast(int n, uint64_t draws)
+{
+    mqd_t pin, pin_children;
+    struct mq_attr attr = {};
+    attr.mq_maxmsg=10;
+    attr.mq_msgsize=sizeof(result_batch);
+
+    //the parent only drains the queue without waiting, children block when it is full
+    if((pin = TEMP_FAILURE_RETRY(mq_open("/bingo_batch", O_RDONLY | O_NONBLOCK | O_CREAT, 0600,&attr)))==-1)
+        ERR("mq_open");
+    if((pin_children = TEMP_FAILURE_RETRY(mq_open("/bingo_batch", O_WRONLY)))==-1)
+        ERR("mq_open");
+
+    draw_board* board;
+    if((board = mmap(NULL, sizeof(draw_board), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0))==MAP_FAILED)
+        ERR("mmap");
+    board->total = UINT64_MAX;
+
+    if(sethandler(sigchldhandler, SIGCHLD)==-1)
+        ERR("sethandler");
+    create_children_fast(n, board, pin_children);
+    parent_work_fast(n, draws, board, pin);
+    while(children_left)
+        sched_yield();
+
+    munmap(board, sizeof(draw_board));
+    mq_close(pin_children);
+    mq_close(pin);
+    mq_unlink("/bingo_batch");
+    return EXIT_SUCCESS;
+}
+
 int main(int argc, char** argv)
 {
-    if(argc!=2)
+    if(argc!=2 && argc!=3)
         usage(argv[0]);
     int n = atoi(argv[1]);
-    if(n<=0 || n>=100)
+    if(n<=0 || n>MAX_PLAYERS)
         usage(argv[0]);
+    if(argc==3)
+    {
+        long long draws = atoll(argv[2]);
+        if(draws<=0)
+            usage(argv[0]);
+        return main_fast(n, (uint64_t)draws);
+    }
     
     mqd_t pin, pout;
     struct mq_attr attr = {};
@@ -4,7 +4,12 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
@@ -15,20 +20,69 @@
 #define MSG_SIZE 256
 #define MAX_MSG_COUNT 4
 #define LIFE_SPAN 10
+#define SEND_TIMEOUT 1
+#define STOP_MESSAGE "\x04"
+
+typedef struct message_t
+{
+    struct timespec sent;
+    char text[MSG_SIZE - sizeof(struct timespec)];
+}message_t;
 
 typedef struct child_data
 {
     char* name;
     mqd_t queue;
+    uint64_t received;
+    uint64_t total_latency_ns;
+    uint64_t max_latency_ns;
 }child_data;
 
+//Process-shared barrier passed by every child once it sent all its messages,
+//so receivers keep working until nobody can send to them anymore
+pthread_barrier_t* all_sent = NULL;
+//Pids of the children in shared memory, filled in by the parent as it forks them,
+//so a sender can tell a slow receiver from one that is gone
+pid_t* child_pids = NULL;
+
 void usage(char* pname)
 {
-    fprintf(stderr,"USAGE:%s", pname);
+    fprintf(stderr,"USAGE:%s n [notify|thread] [messages]\n", pname);
+    fprintf(stderr,"notify - receive through SIGEV_THREAD notifications (default)\n");
+    fprintf(stderr,"thread - receive in one long-lived thread blocked in mq_receive\n");
+    fprintf(stderr,"messages - how many messages each child sends, without sleeping in between\n");
     exit(EXIT_FAILURE);
 }
 
-void create_queues(mqd_t* queues,char** queue_names,int n)
+uint64_t elapsed_ns(struct timespec* since)
+{
+    struct timespec now;
+    if(clock_gettime(CLOCK_MONOTONIC, &now))
+        ERR("clock_gettime");
+    return (now.tv_sec - since->tv_sec) * 1000000000ULL + now.tv_nsec - since->tv_nsec;
+}
+
+void record_latency(child_data* data, struct timespec* sent)
+{
+    uint64_t latency = elapsed_ns(sent);
+    uint64_t max = __atomic_load_n(&data->max_latency_ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&data->received, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&data->total_latency_ns, latency, __ATOMIC_RELAXED);
+    while(latency > max && !__atomic_compare_exchange_n(&data->max_latency_ns, &max, latency, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){}
+}
+
+void print_stats(child_data* data)
+{
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage))
+        ERR("getrusage");
+    double cpu_us = usage.ru_utime.tv_sec * 1e6 + usage.ru_utime.tv_usec + usage.ru_stime.tv_sec * 1e6 + usage.ru_stime.tv_usec;
+    uint64_t received = data->received ? data->received : 1;
+    printf("%s: received %lu messages, latency avg %.1f us max %.1f us, CPU %.1f us/message\n", data->name, data->received,
+           data->total_latency_ns / 1e3 / received, data->max_latency_ns / 1e3, cpu_us / received);
+}
+
+void create_queues(mqd_t* queues,char** queue_names,int n,int flags)
 {
     for(int i = 0; i<n;i++)
     {
@@ -36,7 +90,7 @@ void create_queues(mqd_t* queues,char** queue_names,int n)
         attr.mq_maxmsg = MAX_MSG_COUNT;
         attr.mq_msgsize = MSG_SIZE;
 
-        queues[i] = mq_open(queue_names[i],O_RDWR|O_NONBLOCK|O_CREAT, 0600,&attr);
+        queues[i] = mq_open(queue_names[i],O_RDWR|O_CREAT|flags, 0600,&attr);
         if(queues[i]==-1)
             ERR("mq_open");
     }
@@ -44,7 +98,7 @@ void create_queues(mqd_t* queues,char** queue_names,int n)
 void handle_messages(union sigval sv)
 {
     child_data* data = sv.sival_ptr;
-    char message[MSG_SIZE];
+    message_t message;
 
     struct sigevent notification = {};
     notification.sigev_notify = SIGEV_THREAD;
@@ -57,18 +111,82 @@ void handle_messages(union sigval sv)
     
     while(1)
     {
-        int res=mq_receive(data->queue,message,MSG_SIZE,0);
+        int res=mq_receive(data->queue,(char*)&message,MSG_SIZE,0);
         if(res==-1)
         {
             if(errno == EAGAIN)
                 break;
             ERR("mq_receive");
         }
-        printf("[%s]: %s\n",data->name,message);
+        printf("[%s]: %s\n",data->name,message.text);
+        record_latency(data, &message.sent);
+    }
+}
+
+void* receiver_thread(void* args)
+{
+    child_data* data = args;
+    message_t message;
+
+    while(1)
+    {
+        if(TEMP_FAILURE_RETRY(mq_receive(data->queue,(char*)&message,MSG_SIZE,0))==-1)
+            ERR("mq_receive");
+        if(strcmp(message.text, STOP_MESSAGE)==0)
+            break;
+        printf("[%s]: %s\n",data->name,message.text);
+        record_latency(data, &message.sent);
     }
+    return NULL;
+}
+
+// A child whose pid is not known yet has just been forked and counts as alive
+int child_alive(int child)
+{
+    pid_t pid = __atomic_load_n(&child_pids[child], __ATOMIC_ACQUIRE);
+    return pid == 0 || kill(pid, 0) == 0 || errno != ESRCH;
 }
 
-void child_work(mqd_t* queues,char** names,int n,int child_index)
+/**
+ * Sends a message to the queue of child receiver.
+ * In the thread mode a send waits SEND_TIMEOUT seconds at a time and is retried for as long
+ * as the receiver exists, so a message is dropped only when nobody is left to read it.
+ * In the notify mode the queues are non-blocking.
+ * @return 1 if the message was sent, 0 if the receiver is gone.
+ */
+int send_message(mqd_t queue, int receiver, message_t* message, int timed)
+{
+    while(1)
+    {
+        if(clock_gettime(CLOCK_MONOTONIC, &message->sent))
+            ERR("clock_gettime");
+        if(!timed)
+        {
+            if(mq_send(queue,(char*)message,MSG_SIZE,0)==-1)
+            {
+                if(errno==EAGAIN)
+                    continue;
+                ERR("mq_send");
+            }
+            return 1;
+        }
+        struct timespec timeout;
+        if(clock_gettime(CLOCK_REALTIME, &timeout))
+            ERR("clock_gettime");
+        timeout.tv_sec += SEND_TIMEOUT;
+        if(TEMP_FAILURE_RETRY(mq_timedsend(queue,(char*)message,MSG_SIZE,0,&timeout))==0)
+            return 1;
+        if(errno!=ETIMEDOUT)
+            ERR("mq_timedsend");
+        if(!child_alive(receiver))
+        {
+            printf("Nemo audit: %s\n", message->text);
+            return 0;
+        }
+    }
+}
+
+void child_work(mqd_t* queues,char** names,int n,int child_index,int threaded,int messages)
 {
     srand(getpid());
     printf("[%d] I am here\n", getpid());
@@ -77,66 +195,106 @@ void child_work(mqd_t* queues,char** names,int n,int child_index)
     data.name = names[child_index];
     data.queue=queues[child_index];
 
-    union sigval sv;
-    sv.sival_ptr=&data;
-    handle_messages(sv);
+    pthread_t receiver;
+    if(threaded)
+    {
+        if(pthread_create(&receiver,NULL,receiver_thread,&data))
+            ERR("pthread_create");
+    }
+    else
+    {
+        union sigval sv;
+        sv.sival_ptr=&data;
+        handle_messages(sv);
+    }
 
-    for(int i = 0; i<LIFE_SPAN;i++)
+    int count = messages ? messages : LIFE_SPAN;
+    for(int i = 0; i<count;i++)
     {
         int receiver = rand()%n;
-        char message[MSG_SIZE];
+        message_t message;
         switch(rand()%3)
         {
             case 0:
-                snprintf(message, MSG_SIZE, "Salve %s!", names[receiver]);
+                snprintf(message.text, sizeof(message.text), "Salve %s!", names[receiver]);
                 break;
             case 1:
-                snprintf(message, MSG_SIZE, "Visne garum emere, %s?", names[receiver]);
+                snprintf(message.text, sizeof(message.text), "Visne garum emere, %s?", names[receiver]);
                 break;
             case 2:
-                snprintf(message, MSG_SIZE, "Fuistine hodie in thermis, %s?", names[receiver]);
+                snprintf(message.text, sizeof(message.text), "Fuistine hodie in thermis, %s?", names[receiver]);
                 break;
         }
-        while(1)
+        send_message(queues[receiver],receiver,&message,threaded);
+        if(!messages)
+            sleep(1);
+    }
+    if(all_sent)
+    {
+        int res = pthread_barrier_wait(all_sent);
+        if(res!=0 && res!=PTHREAD_BARRIER_SERIAL_THREAD)
+            ERR("pthread_barrier_wait");
+    }
+    if(threaded)
+    {
+        message_t stop;
+        strcpy(stop.text, STOP_MESSAGE);
+        //the receiver only leaves on STOP, send_message keeps trying while this process, its reader, is alive
+        send_message(data.queue,child_index,&stop,threaded);
+        pthread_join(receiver,NULL);
+    }
+    else if(all_sent)
+    {
+        struct mq_attr attr;
+        do
         {
-            int res=mq_send(queues[receiver],message,MSG_SIZE,0);
-            if(res==-1)
-            {
-                if(errno==EAGAIN)
-                    continue;
-                ERR("mq_send");
-            }
-            break;
-        }
-        sleep(1);
+            if(mq_getattr(data.queue,&attr))
+                ERR("mq_getattr");
+            sched_yield();
+        }while(attr.mq_curmsgs>0);
     }
+    print_stats(&data);
     printf("%s: Disceo.\n", names[child_index]);
     exit(EXIT_SUCCESS);
 }
 
-void create_children(mqd_t* queues,char** names,int n)
+void create_children(mqd_t* queues,char** names,int n,int threaded,int messages)
 {
     for(int i = 0; i<n;i++)
     {
-        switch(fork())
+        pid_t pid;
+        switch(pid = fork())
         {
             case 0:
             {
-                child_work(queues,names,n,i);
+                child_work(queues,names,n,i,threaded,messages);
             }
             case -1:
                 ERR("fork");
+            default:
+                __atomic_store_n(&child_pids[i], pid, __ATOMIC_RELEASE);
         }
     }
 }
 
 int main(int argc, char** argv)
 {
-    if(argc!=2)
+    if(argc<2 || argc>4)
         usage(argv[0]);
     int n = atoi(argv[1]);
     if(n<=0 || n>100)
         usage(argv[0]);
+    int threaded = 0;
+    if(argc>2)
+    {
+        if(strcmp(argv[2],"thread")==0)
+            threaded = 1;
+        else if(strcmp(argv[2],"notify")!=0)
+            usage(argv[0]);
+    }
+    int messages = 0;
+    if(argc>3 && (messages = atoi(argv[3]))<=0)
+        usage(argv[0]);
     
     mqd_t* queues = (mqd_t*)malloc(sizeof(mqd_t)*n);
     char** queue_names = malloc(sizeof(char*)*n);
@@ -150,8 +308,21 @@ int main(int argc, char** argv)
     }
     if(!queues || !queue_names || !names)
         ERR("malloc");
-    create_queues(queues,queue_names,n);
-    create_children(queues,names,n);
+    if(threaded || messages)
+    {
+        if((all_sent = mmap(NULL,sizeof(pthread_barrier_t),PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0))==MAP_FAILED)
+            ERR("mmap");
+        pthread_barrierattr_t attr;
+        pthread_barrierattr_init(&attr);
+        pthread_barrierattr_setpshared(&attr,PTHREAD_PROCESS_SHARED);
+        if(pthread_barrier_init(all_sent,&attr,n))
+            ERR("pthread_barrier_init");
+        pthread_barrierattr_destroy(&attr);
+    }
+    if((child_pids = mmap(NULL,sizeof(pid_t)*n,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0))==MAP_FAILED)
+        ERR("mmap");
+    create_queues(queues,queue_names,n,threaded ? 0 : O_NONBLOCK);
+    create_children(queues,names,n,threaded,messages);
 
     while (wait(NULL) > 0){}
     
@@ -167,6 +338,12 @@ int main(int argc, char** argv)
         free(names[i]);
     }
     free(queue_names);
+    if(all_sent)
+    {
+        pthread_barrier_destroy(all_sent);
+        munmap(all_sent,sizeof(pthread_barrier_t));
+    }
+    munmap(child_pids,sizeof(pid_t)*n);
     printf("Parens: Disceo.\n");
     return EXIT_SUCCESS;
 }
@@ -1,11 +1,15 @@
+#define _GNU_SOURCE
 #include <asm-generic/errno.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <mqueue.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
@@ -20,6 +24,13 @@
 #define OPEN_FOR 8
 #define START_TIME 8
 #define MAX_AMOUNT 16
+#define EXPRESS_QUEUE_NAME "/shop_express"
+#define MAX_LANES 16
+#define MAX_CLIENTS 256
+#define MAX_RECORDS (MAX_CLIENTS * MAX_ITEMS)
+#define SERVICE_TIME 100
+#define MAX_ARRIVAL_GAP 200
+#define EXPRESS_PERCENT 10 //share of simulated messages sent with priority to the express lane
 
 static const char* const UNITS[] = {"kg", "l", "dkg", "g"};
 static const char* const PRODUCTS[] = {"mięsa", "śledzi", "octu", "wódki stołowej", "żelatyny"};
@@ -27,6 +38,33 @@ static const char* const PRODUCTS[] = {"mięsa", "śledzi", "octu", "wódki sto
 #define ERR(source) \
     (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
 
+typedef struct
+{
+    struct timespec enqueued;
+    char text[MSG_SIZE - sizeof(struct timespec)]; //empty text closes the lane
+}shop_message;
+
+typedef struct
+{
+    int lane; //0 is the express lane
+    uint64_t wait_ns;
+    uint64_t service_ns;
+}served_record;
+
+typedef struct
+{
+    uint64_t busy_ns;
+    int served;
+}lane_stats;
+
+typedef struct
+{
+    int records_count;
+    int balked;
+    lane_stats lanes[MAX_LANES + 1];
+    served_record records[MAX_RECORDS];
+}shop_stats;
+
 void msleep(unsigned int milisec)
 {
     time_t sec = (int)(milisec / 1000);
@@ -189,8 +227,230 @@ void create_clients()
     }
 }
 
-int main(void)
+uint64_t timespec_diff_ns(struct timespec* from, struct timespec* to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000000000ULL + to->tv_nsec - from->tv_nsec;
+}
+
+void lane_work(int lane, const char* queue_name, shop_stats* stats)
 {
+    mqd_t queue_d;
+    if((queue_d = mq_open(queue_name,O_RDONLY))==-1)
+        ERR("mq_open");
+
+    shop_message message;
+    struct timespec start, end;
+    while(1)
+    {
+        if(TEMP_FAILURE_RETRY(mq_receive(queue_d,(char*)&message,MSG_SIZE,NULL))<0)
+            ERR("mq_receive");
+        if(message.text[0]=='\0')
+            break;
+        if(clock_gettime(CLOCK_MONOTONIC,&start)==-1)
+            ERR("clock_gettime");
+        msleep(SERVICE_TIME);
+        if(clock_gettime(CLOCK_MONOTONIC,&end)==-1)
+            ERR("clock_gettime");
+
+        int i = __atomic_fetch_add(&stats->records_count,1,__ATOMIC_RELAXED);
+        if(i<MAX_RECORDS)
+        {
+            stats->records[i].lane = lane;
+            stats->records[i].wait_ns = timespec_diff_ns(&message.enqueued,&start);
+            stats->records[i].service_ns = timespec_diff_ns(&start,&end);
+        }
+        stats->lanes[lane].busy_ns += timespec_diff_ns(&start,&end);
+        stats->lanes[lane].served++;
+    }
+    mq_close(queue_d);
+    exit(EXIT_SUCCESS);
+}
+
+void sim_client_work(shop_stats* stats)
+{
+    srand(getpid());
+
+    mqd_t queue_d, express_d;
+    if((queue_d = mq_open(SHOP_QUEUE_NAME,O_WRONLY))==-1)
+        ERR("mq_open");
+    if((express_d = mq_open(EXPRESS_QUEUE_NAME,O_WRONLY))==-1)
+        ERR("mq_open");
+
+    int n = MIN_ITEMS + rand()% (MAX_ITEMS-MIN_ITEMS+1);
+    for(int i = 0; i<n;i++)
+    {
+        shop_message message;
+        snprintf(message.text, sizeof(message.text), "%d%s %s\n", 1 + rand()%(MAX_AMOUNT+1), UNITS[rand()%4],PRODUCTS[rand()%5]);
+        //priority traffic is a small part of the load, otherwise the single express lane is the busiest one
+        int P = rand()%100 < EXPRESS_PERCENT;
+
+        struct timespec ts;
+        if(clock_gettime(CLOCK_REALTIME,&ts)==-1)
+            ERR("clock_gettime");
+        ts.tv_sec+=TIMEOUT;
+        if(clock_gettime(CLOCK_MONOTONIC,&message.enqueued)==-1)
+            ERR("clock_gettime");
+
+        int res = TEMP_FAILURE_RETRY(mq_timedsend(P ? express_d : queue_d,(char*)&message,MSG_SIZE,P,&ts));
+        if(res<0 && errno == ETIMEDOUT)
+        {
+            __atomic_fetch_add(&stats->balked,1,__ATOMIC_RELAXED);
+            break;
+        }
+        else if(res<0)
+            ERR("mq_timed_send");
+        msleep(rand()%MAX_ARRIVAL_GAP);
+    }
+    mq_close(queue_d);
+    mq_close(express_d);
+    exit(EXIT_SUCCESS);
+}
+
+int compare_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+void print_percentiles(const char* label, uint64_t* values, int n)
+{
+    if(n==0)
+        return;
+    qsort(values,n,sizeof(uint64_t),compare_u64);
+    printf("%s: p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms\n", label,
+           values[n/2]/1e6, values[n*9/10]/1e6, values[n*99/100]/1e6, values[n-1]/1e6);
+}
+
+void print_report(shop_stats* stats, int lanes, int clients, uint64_t elapsed_ns)
+{
+    int n = stats->records_count < MAX_RECORDS ? stats->records_count : MAX_RECORDS;
+    uint64_t* waits = malloc(sizeof(uint64_t)*(n+1));
+    uint64_t* services = malloc(sizeof(uint64_t)*(n+1));
+    uint64_t* express_waits = malloc(sizeof(uint64_t)*(n+1));
+    uint64_t* utilization = malloc(sizeof(uint64_t)*(lanes+1));
+    if(!waits || !services || !express_waits || !utilization)
+        ERR("malloc");
+
+    int regular = 0, express = 0;
+    for(int i = 0; i<n;i++)
+    {
+        if(stats->records[i].lane == 0)
+            express_waits[express++] = stats->records[i].wait_ns;
+        else
+            waits[regular++] = stats->records[i].wait_ns;
+        services[i] = stats->records[i].service_ns;
+    }
+
+    printf("%d lanes + express, %d clients: served %d, balked %d, %.2f s, %.2f messages/s\n", lanes, clients,
+           stats->records_count, stats->balked, elapsed_ns/1e9, stats->records_count/(elapsed_ns/1e9));
+    print_percentiles("Queue wait", waits, regular);
+    print_percentiles("Express wait", express_waits, express);
+    print_percentiles("Service time", services, n);
+    for(int i = 0; i<=lanes;i++)
+    {
+        //in per mille so that percentiles can reuse the integer helpers
+        utilization[i] = stats->lanes[i].busy_ns * 1000 / elapsed_ns;
+        printf("Lane %d%s: served %d, utilization %.1f%%\n", i, i ? "" : " (express)", stats->lanes[i].served, utilization[i]/10.0);
+    }
+    qsort(utilization+1,lanes,sizeof(uint64_t),compare_u64);
+    printf("Regular lane utilization: min %.1f%%, p50 %.1f%%, max %.1f%%\n",
+           utilization[1]/10.0, utilization[1+lanes/2]/10.0, utilization[lanes]/10.0);
+
+    free(waits);
+    free(services);
+    free(express_waits);
+    free(utilization);
+}
+
+void close_lane(mqd_t queue_d)
+{
+    shop_message message = {};
+    if(TEMP_FAILURE_RETRY(mq_send(queue_d,(char*)&message,MSG_SIZE,0))<0)
+        ERR("mq_send");
+}
+
+void simulate(int lanes, int clients)
+{
+    struct mq_attr attr = {};
+    attr.mq_maxmsg = MAX_MSG_COUNT;
+    attr.mq_msgsize = MSG_SIZE;
+    mqd_t queue_d, express_d;
+    if((queue_d = mq_open(SHOP_QUEUE_NAME,O_WRONLY | O_CREAT, 0600, &attr))==-1)
+        ERR("mq_open");
+    if((express_d = mq_open(EXPRESS_QUEUE_NAME,O_WRONLY | O_CREAT, 0600, &attr))==-1)
+        ERR("mq_open");
+
+    shop_stats* stats;
+    if((stats = mmap(NULL,sizeof(shop_stats),PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0))==MAP_FAILED)
+        ERR("mmap");
+
+    struct timespec start, end;
+    if(clock_gettime(CLOCK_MONOTONIC,&start)==-1)
+        ERR("clock_gettime");
+    for(int i = 0; i<=lanes;i++)
+    {
+        pid_t pid;
+        if((pid=fork())==-1)
+            ERR("fork");
+        if(pid==0)
+            lane_work(i, i ? SHOP_QUEUE_NAME : EXPRESS_QUEUE_NAME, stats);
+    }
+    pid_t* client_pids = malloc(sizeof(pid_t)*clients);
+    if(!client_pids)
+        ERR("malloc");
+    for(int i = 0; i<clients;i++)
+    {
+        if((client_pids[i]=fork())==-1)
+            ERR("fork");
+        if(client_pids[i]==0)
+            sim_client_work(stats);
+    }
+    for(int i = 0; i<clients;i++)
+    {
+        if(TEMP_FAILURE_RETRY(waitpid(client_pids[i],NULL,0))<0)
+            ERR("waitpid");
+    }
+    for(int i = 0; i<lanes;i++)
+        close_lane(queue_d);
+    close_lane(express_d);
+    while(waitpid(0,NULL,0)>0){}
+    if(clock_gettime(CLOCK_MONOTONIC,&end)==-1)
+        ERR("clock_gettime");
+
+    print_report(stats, lanes, clients, timespec_diff_ns(&start,&end));
+
+    free(client_pids);
+    munmap(stats,sizeof(shop_stats));
+    mq_close(queue_d);
+    mq_close(express_d);
+    mq_unlink(SHOP_QUEUE_NAME);
+    mq_unlink(EXPRESS_QUEUE_NAME);
+}
+
+void usage(char* pname)
+{
+    fprintf(stderr, "USAGE: %s [lanes clients]\n", pname);
+    fprintf(stderr, "lanes - number of regular checkout lanes, 1 <= lanes <= %d\n", MAX_LANES);
+    fprintf(stderr, "clients - number of clients, 1 <= clients <= %d\n", MAX_CLIENTS);
+    fprintf(stderr, "Without arguments runs the single checkout shop.\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv)
+{
+    if(argc==3)
+    {
+        int lanes = atoi(argv[1]);
+        int clients = atoi(argv[2]);
+        if(lanes<1 || lanes>MAX_LANES || clients<1 || clients>MAX_CLIENTS)
+            usage(argv[0]);
+        simulate(lanes, clients);
+        return EXIT_SUCCESS;
+    }
+    if(argc!=1)
+        usage(argv[0]);
+
     create_queue();
     create_clients();
 
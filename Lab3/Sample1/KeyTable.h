@@ -0,0 +1,171 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_KEY 64
+#define INITIAL_TABLE_SIZE 1024
+
+/*
+ * Open addressing hash table counting short byte strings (n-grams, words).
+ * Every thread fills its own table without any locking, the tables are
+ * merged with table_merge once the threads are joined.
+ */
+
+typedef struct
+{
+    uint64_t hash;
+    uint64_t count;  // 0 marks an empty slot
+    uint8_t length;
+    char key[MAX_KEY];
+} key_entry;
+
+typedef struct
+{
+    key_entry* entries;
+    size_t capacity;  // always a power of two
+    size_t size;
+} key_table;
+
+void table_init(key_table* table)
+{
+    table->capacity = INITIAL_TABLE_SIZE;
+    table->size = 0;
+    if (!(table->entries = calloc(table->capacity, sizeof(key_entry))))
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void table_free(key_table* table)
+{
+    free(table->entries);
+    table->entries = NULL;
+    table->capacity = table->size = 0;
+}
+
+// FNV-1a
+uint64_t key_hash(const char* key, int length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+key_entry* table_find(key_entry* entries, size_t capacity, uint64_t hash, const char* key, int length)
+{
+    size_t i = hash & (capacity - 1);
+    while (entries[i].count && (entries[i].hash != hash || entries[i].length != length || memcmp(entries[i].key, key, length)))
+        i = (i + 1) & (capacity - 1);
+    return &entries[i];
+}
+
+void table_grow(key_table* table)
+{
+    size_t capacity = table->capacity * 2;
+    key_entry* entries = calloc(capacity, sizeof(key_entry));
+    if (!entries)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < table->capacity; i++)
+    {
+        key_entry* old = &table->entries[i];
+        if (old->count)
+            *table_find(entries, capacity, old->hash, old->key, old->length) = *old;
+    }
+    free(table->entries);
+    table->entries = entries;
+    table->capacity = capacity;
+}
+
+void table_add_hashed(key_table* table, uint64_t hash, const char* key, int length, uint64_t count)
+{
+    key_entry* entry = table_find(table->entries, table->capacity, hash, key, length);
+    if (!entry->count)
+    {
+        entry->hash = hash;
+        entry->length = length;
+        memcpy(entry->key, key, length);
+        // keep the load factor under 1/2 so probe sequences stay short
+        if (++table->size * 2 > table->capacity)
+        {
+            entry->count = count;
+            table_grow(table);
+            return;
+        }
+    }
+    entry->count += count;
+}
+
+void table_add(key_table* table, const char* key, int length, uint64_t count)
+{
+    if (length > MAX_KEY)
+        length = MAX_KEY;
+    table_add_hashed(table, key_hash(key, length), key, length, count);
+}
+
+void table_merge(key_table* to, key_table* from)
+{
+    for (size_t i = 0; i < from->capacity; i++)
+    {
+        key_entry* entry = &from->entries[i];
+        if (entry->count)
+            table_add_hashed(to, entry->hash, entry->key, entry->length, entry->count);
+    }
+}
+
+int compare_entries(const void* a, const void* b)
+{
+    uint64_t x = (*(key_entry* const*)a)->count;
+    uint64_t y = (*(key_entry* const*)b)->count;
+    return (x < y) - (x > y);
+}
+
+// Control characters are escaped, bytes of multi-byte UTF-8 characters are printed as they are
+void print_key(const char* key, int length)
+{
+    for (int i = 0; i < length; i++)
+    {
+        unsigned char c = key[i];
+        if (c == '\n')
+            printf("\\n");
+        else if (c == '\t')
+            printf("\\t");
+        else if (c < 0x20 || c == 0x7f)
+            printf("\\x%02x", c);
+        else
+            putchar(c);
+    }
+}
+
+void table_print_top(key_table* table, int k)
+{
+    key_entry** sorted = malloc(sizeof(key_entry*) * (table->size + 1));
+    if (!sorted)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < table->capacity; i++)
+    {
+        if (table->entries[i].count)
+            sorted[n++] = &table->entries[i];
+    }
+    qsort(sorted, n, sizeof(key_entry*), compare_entries);
+    for (size_t i = 0; i < n && i < (size_t)k; i++)
+    {
+        printf("\"");
+        print_key(sorted[i]->key, sorted[i]->length);
+        printf("\": %lu\n", sorted[i]->count);
+    }
+    printf("%zu distinct keys\n", n);
+    free(sorted);
+}
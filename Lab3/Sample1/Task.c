@@ -2,72 +2,583 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "KeyTable.h"
 
 #define ERR(source) \
     (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
+//Consecutive bytes go to different sub-histograms, so repeated characters
+//do not wait for the previous increment of the same counter
+#define SUB_HISTOGRAMS 4
+//Streaming mode maps files in windows of this size, it has to be a multiple of the page size
+#define STREAM_CHUNK (16 << 20)
+#define STREAM_FILES_STEP 1024 //the file list grows by this many entries
+#define DEFAULT_TOP 20
+#define STATE_MAGIC 0x31545349482d4f53ULL
+
+typedef enum
+{
+    MODE_BYTES,
+    MODE_BIGRAMS,
+    MODE_TRIGRAMS,
+    MODE_WORDS,
+    MODE_CODEPOINTS
+}count_mode;
+
+//Code points of the Basic Multilingual Plane are counted in a dense array,
+//the rare ones above it in the hash table under their UTF-8 encoding
+#define BMP_SIZE 0x10000
+
+typedef struct
+{
+    key_table table;
+    uint64_t* bmp;
+    uint64_t invalid; //bytes that do not start a valid UTF-8 sequence
+}key_counts;
 
 typedef struct
 {
     char* file_memory;
-    int* output_data;
+    uint64_t* output_data;
     pthread_mutex_t* mxdata;
-    int start;
-    int end;
+    size_t start;
+    size_t end;
+    size_t size;
+    count_mode mode;
+    key_counts counts;
 }thread_data;
 
+typedef struct
+{
+    const char* path; //every chunk opens its file on its own, so no descriptors are held between chunks
+    size_t offset;
+    size_t length;
+    size_t file_size;
+}stream_chunk;
+
+typedef struct
+{
+    stream_chunk* chunks;
+    size_t chunks_count;
+    size_t* next_chunk; //shared by all threads, each one takes the next chunk when it is done
+    uint64_t* output_data;
+    pthread_mutex_t* mxdata;
+    count_mode mode;
+    key_counts counts;
+}stream_data;
+
+//What the incremental mode remembers between runs
+typedef struct
+{
+    uint64_t magic;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t offset; //everything before it is already counted
+    uint64_t counts[256];
+}histogram_state;
+
+volatile sig_atomic_t last_signal = 0;
+
+//nftw takes no user argument, so the file list is global
+char** stream_paths = NULL;
+size_t* stream_sizes = NULL;
+int stream_files_count = 0;
+
 void usage(char* pname)
 {
-    fprintf(stderr, "Usage%s\n", pname);
+    fprintf(stderr, "Usage: %s [-m mode] [-k K] n file\n", pname);
+    fprintf(stderr, "       %s [-m mode] [-k K] n -s path...\n", pname);
+    fprintf(stderr, "       %s [-w] -i state n file\n", pname);
+    fprintf(stderr, "n - number of threads\n");
+    fprintf(stderr, "-s - stream files and directory trees in %d MB windows without echoing them\n", STREAM_CHUNK >> 20);
+    fprintf(stderr, "-m - what to count: bytes (default), bigrams, trigrams, words or UTF-8 codepoints\n");
+    fprintf(stderr, "-i - count only bytes appended since the last run, byte counts and offset are kept in the state file\n");
+    fprintf(stderr, "-w - with -i, keep watching the file with inotify until SIGINT\n");
+    fprintf(stderr, "-k - how many of the most frequent n-grams, words or code points to print (default %d)\n", DEFAULT_TOP);
     exit(EXIT_FAILURE);
 }
 
+/**
+ * Counts bytes into SUB_HISTOGRAMS private histograms.
+ * It loads 8 bytes at a time and spreads them over the sub-histograms,
+ * the caller sums the sub-histograms afterwards.
+ */
+void count_bytes(const unsigned char* memory, size_t length, uint64_t histogram[SUB_HISTOGRAMS][256])
+{
+    size_t i = 0;
+    for(; i<length && ((uintptr_t)(memory + i) & 7); i++)
+        histogram[0][memory[i]]++;
+    for(; i + 8<=length; i+=8)
+    {
+        uint64_t word;
+        memcpy(&word, memory + i, sizeof(uint64_t));
+        histogram[0][word & 0xff]++;
+        histogram[1][(word >> 8) & 0xff]++;
+        histogram[2][(word >> 16) & 0xff]++;
+        histogram[3][(word >> 24) & 0xff]++;
+        histogram[0][(word >> 32) & 0xff]++;
+        histogram[1][(word >> 40) & 0xff]++;
+        histogram[2][(word >> 48) & 0xff]++;
+        histogram[3][word >> 56]++;
+    }
+    for(; i<length;i++)
+        histogram[i % SUB_HISTOGRAMS][memory[i]]++;
+}
+
+int is_space(unsigned char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/**
+ * Counts n-grams or words starting in memory[0..end) into a private table.
+ * @param before 1 if memory[-1] can be read, a word running into the chunk belongs to the previous one
+ * @param after Number of bytes readable past end, used to finish keys that start before end
+ */
+void count_keys(const unsigned char* memory, size_t end, int before, size_t after, count_mode mode, key_table* table)
+{
+    const char* text = (const char*)memory;
+    if(mode == MODE_BIGRAMS || mode == MODE_TRIGRAMS)
+    {
+        size_t n = mode == MODE_BIGRAMS ? 2 : 3;
+        for(size_t i = 0; i<end && i + n<=end + after; i++)
+            table_add(table, text + i, n, 1);
+        return;
+    }
+
+    size_t i = 0;
+    if(before && !is_space(memory[-1]))
+    {
+        while(i<end && !is_space(memory[i]))
+            i++;
+    }
+    while(1)
+    {
+        while(i<end && is_space(memory[i]))
+            i++;
+        if(i>=end)
+            break;
+        size_t start = i;
+        while(i<end + after && !is_space(memory[i]))
+            i++;
+        table_add(table, text + start, i - start < MAX_KEY ? i - start : MAX_KEY, 1);
+    }
+}
+
+void counts_init(key_counts* counts, count_mode mode)
+{
+    table_init(&counts->table);
+    counts->bmp = NULL;
+    counts->invalid = 0;
+    if(mode == MODE_CODEPOINTS && !(counts->bmp = calloc(BMP_SIZE, sizeof(uint64_t))))
+        ERR("calloc");
+}
+
+void counts_merge(key_counts* to, key_counts* from)
+{
+    table_merge(&to->table, &from->table);
+    to->invalid += from->invalid;
+    if(!from->bmp)
+        return;
+    for(int i = 0; i<BMP_SIZE;i++)
+        to->bmp[i] += from->bmp[i];
+}
+
+void counts_free(key_counts* counts)
+{
+    table_free(&counts->table);
+    free(counts->bmp);
+    counts->bmp = NULL;
+}
+
+int encode_utf8(uint32_t codepoint, char* out)
+{
+    if(codepoint < 0x80)
+    {
+        out[0] = codepoint;
+        return 1;
+    }
+    if(codepoint < 0x800)
+    {
+        out[0] = 0xc0 | (codepoint >> 6);
+        out[1] = 0x80 | (codepoint & 0x3f);
+        return 2;
+    }
+    out[0] = 0xe0 | (codepoint >> 12);
+    out[1] = 0x80 | ((codepoint >> 6) & 0x3f);
+    out[2] = 0x80 | (codepoint & 0x3f);
+    return 3;
+}
+
+void counts_print(key_counts* counts, int top)
+{
+    if(counts->bmp)
+    {
+        //the dense part goes into the table too, so all code points are ranked together
+        char key[4];
+        for(uint32_t i = 0; i<BMP_SIZE;i++)
+        {
+            if(counts->bmp[i])
+                table_add(&counts->table, key, encode_utf8(i, key), counts->bmp[i]);
+        }
+    }
+    table_print_top(&counts->table, top);
+    if(counts->bmp)
+        printf("%lu invalid UTF-8 bytes\n", counts->invalid);
+}
+
+/**
+ * Decodes one UTF-8 sequence, rejecting overlong forms, surrogates and values above U+10FFFF.
+ * @return Length of the sequence, 0 if memory[0] does not start a valid one.
+ */
+int decode_utf8(const unsigned char* memory, size_t available, uint32_t* codepoint)
+{
+    unsigned char c = memory[0];
+    int length;
+    uint32_t min;
+    if(c < 0x80)
+    {
+        *codepoint = c;
+        return 1;
+    }
+    else if(c >= 0xc2 && c <= 0xdf)
+    {
+        length = 2;
+        min = 0x80;
+        *codepoint = c & 0x1f;
+    }
+    else if(c >= 0xe0 && c <= 0xef)
+    {
+        length = 3;
+        min = 0x800;
+        *codepoint = c & 0x0f;
+    }
+    else if(c >= 0xf0 && c <= 0xf4)
+    {
+        length = 4;
+        min = 0x10000;
+        *codepoint = c & 0x07;
+    }
+    else
+        return 0;
+    if((size_t)length > available)
+        return 0;
+    for(int i = 1; i<length;i++)
+    {
+        if((memory[i] & 0xc0) != 0x80)
+            return 0;
+        *codepoint = (*codepoint << 6) | (memory[i] & 0x3f);
+    }
+    if(*codepoint < min || *codepoint > 0x10ffff || (*codepoint >= 0xd800 && *codepoint <= 0xdfff))
+        return 0;
+    return length;
+}
+
+/**
+ * Counts code points whose first byte is in memory[0..end).
+ * Runs of ASCII are checked 16 bytes at a time and counted without decoding.
+ * @param before Number of bytes readable before memory (up to 3), used to skip
+ *               continuation bytes that belong to a sequence of the previous chunk
+ * @param after Number of bytes readable past end (up to 3), used to finish the last sequence
+ */
+void count_codepoints(const unsigned char* memory, size_t end, size_t before, size_t after, key_counts* counts)
+{
+    size_t i = 0;
+    //a continuation byte at the start belongs to the previous chunk if a valid sequence started there covers it
+    for(size_t back = 1; back<=before; back++)
+    {
+        uint32_t codepoint;
+        if((memory[-back] & 0xc0) == 0x80)
+            continue;
+        int length = decode_utf8(memory - back, back + end + after, &codepoint);
+        if(length > (int)back)
+            i = length - back;
+        break;
+    }
+
+    while(i<end)
+    {
+#ifdef __SSE2__
+        while(i + 16<=end && _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(memory + i)))==0)
+        {
+            for(int j = 0; j<16;j++)
+                counts->bmp[memory[i + j]]++;
+            i += 16;
+        }
+#else
+        uint64_t word;
+        while(i + 8<=end && (memcpy(&word, memory + i, 8), (word & 0x8080808080808080ULL)==0))
+        {
+            for(int j = 0; j<8;j++)
+                counts->bmp[memory[i + j]]++;
+            i += 8;
+        }
+#endif
+        if(i>=end)
+            break;
+        if(memory[i] < 0x80)
+        {
+            counts->bmp[memory[i++]]++;
+            continue;
+        }
+        uint32_t codepoint;
+        int length = decode_utf8(memory + i, end + after - i, &codepoint);
+        if(length == 0)
+        {
+            counts->invalid++;
+            i++;
+        }
+        else if(codepoint < BMP_SIZE)
+        {
+            counts->bmp[codepoint]++;
+            i += length;
+        }
+        else
+        {
+            table_add(&counts->table, (const char*)memory + i, length, 1);
+            i += length;
+        }
+    }
+}
+
+//The shared counters are touched once per character, not once per byte
+void merge_histogram(uint64_t histogram[SUB_HISTOGRAMS][256], uint64_t* output_data, pthread_mutex_t* mxdata)
+{
+    for(int c = 0; c<256;c++)
+    {
+        uint64_t count = 0;
+        for(int j = 0; j<SUB_HISTOGRAMS;j++)
+            count += histogram[j][c];
+        if(count == 0)
+            continue;
+        pthread_mutex_lock(&mxdata[c]);
+        output_data[c] += count;
+        pthread_mutex_unlock(&mxdata[c]);
+    }
+}
+
 void* thread_work(void* args)
 {
     thread_data* data = (thread_data*)args;
-    for(int i = data->start; i<data->end;i++)
+    uint64_t histogram[SUB_HISTOGRAMS][256] = {};
+
+    if(data->mode == MODE_CODEPOINTS)
     {
-        unsigned char c = (unsigned char)data->file_memory[i];
-        pthread_mutex_lock(&data->mxdata[c]);
-        data->output_data[c]++;
-        pthread_mutex_unlock(&data->mxdata[c]);
+        size_t after = data->size - data->end < 3 ? data->size - data->end : 3;
+        size_t before = data->start < 3 ? data->start : 3;
+        count_codepoints((unsigned char*)data->file_memory + data->start, data->end - data->start, before, after, &data->counts);
+        return NULL;
     }
+    if(data->mode != MODE_BYTES)
+    {
+        size_t after = data->size - data->end < MAX_KEY ? data->size - data->end : MAX_KEY;
+        count_keys((unsigned char*)data->file_memory + data->start, data->end - data->start, data->start > 0, after, data->mode, &data->counts.table);
+        return NULL;
+    }
+    count_bytes((unsigned char*)data->file_memory + data->start, data->end - data->start, histogram);
+    merge_histogram(histogram, data->output_data, data->mxdata);
     return NULL;
 }
 
-void parent_work(int* output_data)
+void* stream_work(void* args)
 {
-    for(int i = 0; i<256;i++)
+    stream_data* data = (stream_data*)args;
+    uint64_t histogram[SUB_HISTOGRAMS][256] = {};
+    size_t i;
+
+    while((i = __atomic_fetch_add(data->next_chunk, 1, __ATOMIC_RELAXED)) < data->chunks_count)
     {
-        if(output_data[i]>0)
-            printf("%c: %d\n", i, output_data[i]);
+        stream_chunk* chunk = &data->chunks[i];
+        //Key modes also map the page before the window and a few bytes after it,
+        //so n-grams and words crossing the window border are counted exactly once
+        size_t lead = 0, after = 0;
+        if(data->mode != MODE_BYTES)
+        {
+            lead = chunk->offset ? (size_t)getpagesize() : 0;
+            after = chunk->file_size - chunk->offset - chunk->length;
+            if(after > MAX_KEY)
+                after = MAX_KEY;
+        }
+        size_t length = lead + chunk->length + after;
+        int fd;
+        if((fd = open(chunk->path, O_RDONLY))==-1)
+            ERR("open");
+        char* memory;
+        if((memory = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, chunk->offset - lead))==MAP_FAILED)
+            ERR("mmap");
+        if(madvise(memory, length, MADV_SEQUENTIAL))
+            ERR("madvise");
+        if(data->mode == MODE_BYTES)
+            count_bytes((unsigned char*)memory, chunk->length, histogram);
+        else if(data->mode == MODE_CODEPOINTS)
+            count_codepoints((unsigned char*)memory + lead, chunk->length, lead ? 3 : 0, after < 3 ? after : 3, &data->counts);
+        else
+            count_keys((unsigned char*)memory + lead, chunk->length, lead > 0, after, data->mode, &data->counts.table);
+        if(munmap(memory, length))
+            ERR("munmap");
+        //Drop the window from the page cache right away, so inputs larger than RAM do not push everything else out.
+        //Only clean pages no one else maps are dropped, it is a hint and failing it is harmless
+        posix_fadvise(fd, chunk->offset - lead, length, POSIX_FADV_DONTNEED);
+        if(close(fd))
+            ERR("close");
     }
+    if(data->mode == MODE_BYTES)
+        merge_histogram(histogram, data->output_data, data->mxdata);
+    return NULL;
 }
 
-int main(int argc, char** argv)
+int add_stream_file(const char* path, const struct stat* st, int type, struct FTW* ftw)
 {
-    if(argc!=3)
-        usage(argv[0]);
-    int n = atoi(argv[1]);
-    char* filename = argv[2];
+    if(type != FTW_F || !S_ISREG(st->st_mode) || st->st_size == 0)
+        return 0;
+    if(stream_files_count % STREAM_FILES_STEP == 0)
+    {
+        stream_paths = realloc(stream_paths, sizeof(char*)*(stream_files_count + STREAM_FILES_STEP));
+        stream_sizes = realloc(stream_sizes, sizeof(size_t)*(stream_files_count + STREAM_FILES_STEP));
+        if(!stream_paths || !stream_sizes)
+            ERR("realloc");
+    }
+    if(!(stream_paths[stream_files_count] = strdup(path)))
+        ERR("strdup");
+    stream_sizes[stream_files_count++] = st->st_size;
+    return 0;
+}
+
+/**
+ * Counts bytes of every regular file under the given paths.
+ * Files are cut into STREAM_CHUNK windows that the threads take from a shared queue.
+ * @return Number of counted bytes.
+ */
+size_t stream_files(int n, char** paths, int paths_count, uint64_t* output_data, pthread_mutex_t* mxdata, count_mode mode, key_counts* result)
+{
+    for(int i = 0; i<paths_count;i++)
+    {
+        if(nftw(paths[i], add_stream_file, 64, FTW_PHYS)==-1)
+            ERR("nftw");
+    }
+
+    size_t chunks_count = 0, total = 0;
+    for(int i = 0; i<stream_files_count;i++)
+        chunks_count += (stream_sizes[i] + STREAM_CHUNK - 1) / STREAM_CHUNK;
+    stream_chunk* chunks = malloc(sizeof(stream_chunk)*(chunks_count + 1));
+    stream_data* data = malloc(sizeof(stream_data)*n);
+    pthread_t* tids = malloc(sizeof(pthread_t)*n);
+    if(!chunks || !data || !tids)
+        ERR("malloc");
+
+    size_t c = 0;
+    for(int i = 0; i<stream_files_count;i++)
+    {
+        for(size_t offset = 0; offset<stream_sizes[i]; offset += STREAM_CHUNK, c++)
+        {
+            chunks[c].path = stream_paths[i];
+            chunks[c].offset = offset;
+            chunks[c].length = stream_sizes[i] - offset < STREAM_CHUNK ? stream_sizes[i] - offset : STREAM_CHUNK;
+            chunks[c].file_size = stream_sizes[i];
+        }
+        total += stream_sizes[i];
+    }
+
+    size_t next_chunk = 0;
+    for(int i = 0; i<n;i++)
+    {
+        data[i].chunks = chunks;
+        data[i].chunks_count = chunks_count;
+        data[i].next_chunk = &next_chunk;
+        data[i].output_data = output_data;
+        data[i].mxdata = mxdata;
+        data[i].mode = mode;
+        if(mode != MODE_BYTES)
+            counts_init(&data[i].counts, mode);
+        if(pthread_create(&tids[i],NULL, stream_work,&data[i]))
+            ERR("pthread_create");
+    }
+    for(int i = 0; i<n;i++)
+    {
+        pthread_join(tids[i],NULL);
+        if(mode != MODE_BYTES)
+        {
+            counts_merge(result, &data[i].counts);
+            counts_free(&data[i].counts);
+        }
+    }
 
+    for(int i = 0; i<stream_files_count;i++)
+        free(stream_paths[i]);
+    free(stream_paths);
+    free(stream_sizes);
+    free(chunks);
+    free(data);
+    free(tids);
+    return total;
+}
+
+void count_memory(int n, char* memory, size_t size, uint64_t* output_data, pthread_mutex_t* mxdata, count_mode mode, key_counts* result)
+{
+    thread_data* data = (thread_data*)malloc(sizeof(thread_data)*n);
+    pthread_t* tids = (pthread_t*)malloc(sizeof(pthread_t)*n);
+    if(!tids || !data)
+        ERR("malloc");
+
+    size_t chunk_size = size/n;
+    for(int i = 0; i<n;i++)
+    {
+        if(i == n-1)
+            data[i].end = size;
+        else
+            data[i].end = (i+1)*chunk_size;
+
+        data[i].start = i*chunk_size;
+        data[i].file_memory = memory;
+        data[i].output_data = output_data;
+        data[i].mxdata = mxdata;
+        data[i].size = size;
+        data[i].mode = mode;
+        if(mode != MODE_BYTES)
+            counts_init(&data[i].counts, mode);
+
+        if(pthread_create(&tids[i],NULL, thread_work,&data[i])==-1)
+            ERR("pthread_create");
+    }
+
+    for(int i = 0; i<n;i++)
+    {
+        pthread_join(tids[i],NULL);
+        if(mode != MODE_BYTES)
+        {
+            counts_merge(result, &data[i].counts);
+            counts_free(&data[i].counts);
+        }
+    }
+
+    free(tids);
+    free(data);
+}
+
+size_t count_file(int n, char* filename, uint64_t* output_data, pthread_mutex_t* mxdata, count_mode mode, key_counts* result)
+{
     int fd;
     if((fd = open(filename, O_CREAT | O_RDWR, 0666))==-1)
         ERR("open");
-    
-    int fd2;
-    if((fd2=shm_open("/output_data", O_CREAT | O_RDWR | O_TRUNC, 0666))==-1)
-        ERR("shm_open");
-    if (ftruncate(fd2, sizeof(int)*256) == -1)
-        ERR("ftruncate");
 
     struct stat st;
     fstat(fd, &st);
@@ -75,19 +586,241 @@ int main(int argc, char** argv)
     char* file_memory;
     if((file_memory = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0))==MAP_FAILED)
         ERR("mmap");
-    
-    int* output_data;
-    if((output_data = mmap(NULL, sizeof(int)*256,PROT_WRITE | PROT_READ, MAP_SHARED,fd2,0))==MAP_FAILED)
+
+    for(size_t written = 0; written<(size_t)st.st_size;)
+    {
+        ssize_t res = write(STDOUT_FILENO, file_memory + written, st.st_size - written);
+        if(res<0)
+        {
+            if(errno == EINTR)
+                continue;
+            ERR("write");
+        }
+        written += res;
+    }
+
+    count_memory(n, file_memory, st.st_size, output_data, mxdata, mode, result);
+
+    close(fd);
+    munmap(file_memory,st.st_size);
+    return st.st_size;
+}
+
+void save_state(char* state_path, histogram_state* state)
+{
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, PATH_MAX, "%s.tmp", state_path);
+    int fd;
+    if((fd = open(tmp_path, O_CREAT | O_WRONLY | O_TRUNC, 0666))==-1)
+        ERR("open");
+    if(write(fd, state, sizeof(histogram_state))!=sizeof(histogram_state))
+        ERR("write");
+    if(fsync(fd))
+        ERR("fsync");
+    close(fd);
+    //rename is atomic, so a crash leaves either the old or the new state
+    if(rename(tmp_path, state_path))
+        ERR("rename");
+}
+
+/**
+ * Counts the bytes appended to the file since the offset kept in the state file.
+ * The whole file is counted again if it was replaced, truncated or rewritten in place.
+ * @return Number of counted bytes.
+ */
+size_t update_file(int n, char* filename, char* state_path, uint64_t* output_data, pthread_mutex_t* mxdata)
+{
+    int fd;
+    if((fd = open(filename, O_RDONLY))==-1)
+        ERR("open");
+    struct stat st;
+    if(fstat(fd, &st))
+        ERR("fstat");
+
+    histogram_state state = {};
+    int state_fd = open(state_path, O_RDONLY);
+    if(state_fd==-1 && errno!=ENOENT)
+        ERR("open");
+    if(state_fd!=-1)
+    {
+        if(read(state_fd, &state, sizeof(histogram_state))!=sizeof(histogram_state) || state.magic!=STATE_MAGIC)
+            memset(&state, 0, sizeof(histogram_state));
+        close(state_fd);
+    }
+    int same_file = state.magic==STATE_MAGIC && state.dev==st.st_dev && state.ino==st.st_ino && state.offset<=(uint64_t)st.st_size;
+    int rewritten = state.offset==(uint64_t)st.st_size && (state.mtime_sec!=st.st_mtim.tv_sec || state.mtime_nsec!=st.st_mtim.tv_nsec);
+    if(!same_file || rewritten)
+        memset(&state, 0, sizeof(histogram_state));
+
+    size_t start = state.offset;
+    size_t end = st.st_size;
+    memcpy(output_data, state.counts, sizeof(uint64_t)*256);
+    if(start<end)
+    {
+        //mmap needs a page aligned offset
+        size_t map_start = start & ~((size_t)getpagesize() - 1);
+        char* memory;
+        if((memory = mmap(NULL, end - map_start, PROT_READ, MAP_SHARED, fd, map_start))==MAP_FAILED)
+            ERR("mmap");
+        count_memory(n, memory + (start - map_start), end - start, output_data, mxdata, MODE_BYTES, NULL);
+        munmap(memory, end - map_start);
+    }
+    close(fd);
+
+    state.magic = STATE_MAGIC;
+    state.dev = st.st_dev;
+    state.ino = st.st_ino;
+    state.mtime_sec = st.st_mtim.tv_sec;
+    state.mtime_nsec = st.st_mtim.tv_nsec;
+    state.offset = end;
+    memcpy(state.counts, output_data, sizeof(uint64_t)*256);
+    save_state(state_path, &state);
+    return end - start;
+}
+
+int sethandler(void(*f)(int), int sig)
+{
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = f;
+    if(sigaction(sig, &act,NULL)==-1)
+        return -1;
+    return 0;
+}
+
+void sigint_handler(int sig)
+{
+    last_signal = sig;
+}
+
+int add_watch(int inotify_fd, char* filename)
+{
+    int wd = inotify_add_watch(inotify_fd, filename, IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+    if(wd==-1)
+        ERR("inotify_add_watch");
+    return wd;
+}
+
+/**
+ * Counts new bytes every time the file changes, until SIGINT.
+ * A moved or deleted file (log rotation) is watched again under the same name.
+ */
+void watch_file(int n, char* filename, char* state_path, uint64_t* output_data, pthread_mutex_t* mxdata)
+{
+    if(sethandler(sigint_handler, SIGINT))
+        ERR("sethandler");
+    int inotify_fd;
+    if((inotify_fd = inotify_init1(0))==-1)
+        ERR("inotify_init1");
+    add_watch(inotify_fd, filename);
+
+    char events[sizeof(struct inotify_event) + NAME_MAX + 1] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while(last_signal!=SIGINT)
+    {
+        ssize_t len = read(inotify_fd, events, sizeof(events));
+        if(len<0)
+        {
+            if(errno==EINTR)
+                continue;
+            ERR("read");
+        }
+        int rewatch = 0;
+        for(char* ptr = events; ptr<events + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event*)ptr)->len)
+        {
+            if(((struct inotify_event*)ptr)->mask & (IN_MOVE_SELF | IN_DELETE_SELF))
+                rewatch = 1;
+        }
+        if(rewatch)
+        {
+            //wait until the file is created again under the old name
+            while(access(filename, F_OK) && last_signal!=SIGINT)
+                sleep(1);
+            if(last_signal==SIGINT)
+                break;
+            add_watch(inotify_fd, filename);
+        }
+        size_t counted = update_file(n, filename, state_path, output_data, mxdata);
+        if(counted)
+            fprintf(stderr, "Counted %zu new bytes\n", counted);
+    }
+    close(inotify_fd);
+}
+
+void parent_work(uint64_t* output_data)
+{
+    for(int i = 0; i<256;i++)
+    {
+        if(output_data[i]>0)
+            printf("%c: %lu\n", i, output_data[i]);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    count_mode mode = MODE_BYTES;
+    int top = DEFAULT_TOP;
+    int streaming = 0;
+    int watching = 0;
+    char* state_path = NULL;
+    int c;
+    while((c = getopt(argc, argv, "sm:k:i:w"))!=-1)
+    {
+        switch(c)
+        {
+            case 'i':
+                state_path = optarg;
+                break;
+            case 'w':
+                watching = 1;
+                break;
+            case 's':
+                streaming = 1;
+                break;
+            case 'm':
+                if(strcmp(optarg, "bytes")==0)
+                    mode = MODE_BYTES;
+                else if(strcmp(optarg, "bigrams")==0)
+                    mode = MODE_BIGRAMS;
+                else if(strcmp(optarg, "trigrams")==0)
+                    mode = MODE_TRIGRAMS;
+                else if(strcmp(optarg, "words")==0)
+                    mode = MODE_WORDS;
+                else if(strcmp(optarg, "codepoints")==0)
+                    mode = MODE_CODEPOINTS;
+                else
+                    usage(argv[0]);
+                break;
+            case 'k':
+                if((top = atoi(optarg))<=0)
+                    usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(argc - optind<2 || (!streaming && argc - optind!=2))
+        usage(argv[0]);
+    if(state_path && (streaming || mode != MODE_BYTES))
+        usage(argv[0]);
+    if(watching && !state_path)
+        usage(argv[0]);
+    int n = atoi(argv[optind]);
+    if(n<=0)
+        usage(argv[0]);
+
+    int fd2;
+    if((fd2=shm_open("/output_data", O_CREAT | O_RDWR | O_TRUNC, 0666))==-1)
+        ERR("shm_open");
+    if (ftruncate(fd2, sizeof(uint64_t)*256) == -1)
+        ERR("ftruncate");
+
+    uint64_t* output_data;
+    if((output_data = mmap(NULL, sizeof(uint64_t)*256,PROT_WRITE | PROT_READ, MAP_SHARED,fd2,0))==MAP_FAILED)
         ERR("mmap");
-    
-    for(int i = 0; i<st.st_size;i++)
-        write(STDOUT_FILENO, &file_memory[i],1);
 
-    thread_data* data = (thread_data*)malloc(sizeof(thread_data)*n);
-    pthread_t* tids = (pthread_t*)malloc(sizeof(pthread_t)*n);
     pthread_mutex_t* mxdata = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t)*256);
     pthread_mutexattr_t*mxattr = (pthread_mutexattr_t*)malloc(sizeof(pthread_mutexattr_t)*256);
-    if(!tids || !data || !mxdata || !mxattr)
+    if(!mxdata || !mxattr)
         ERR("malloc");
 
     for(int i =0; i<256;i++)
@@ -98,44 +831,43 @@ int main(int argc, char** argv)
         pthread_mutex_init(&mxdata[i], &mxattr[i]);
     }
 
-    int chunk_size = st.st_size/n;
-
-    for(int i = 0; i<n;i++)
-    {
-        if(i == n-1)
-            data[i].end = st.st_size;
-        else
-            data[i].end = (i+1)*chunk_size;
-
-        data[i].start = i*chunk_size;
-        data[i].file_memory = file_memory;
-        data[i].output_data = output_data;
-        data[i].mxdata = mxdata;
-
-        if(pthread_create(&tids[i],NULL, thread_work,&data[i])==-1)
-            ERR("pthread_create");
-    }
+    struct timespec start, end;
+    if(clock_gettime(CLOCK_MONOTONIC, &start))
+        ERR("clock_gettime");
+    size_t total;
+    key_counts result;
+    if(mode != MODE_BYTES)
+        counts_init(&result, mode);
+    if(state_path)
+        total = update_file(n, argv[optind + 1], state_path, output_data, mxdata);
+    else if(streaming)
+        total = stream_files(n, argv + optind + 1, argc - optind - 1, output_data, mxdata, mode, &result);
+    else
+        total = count_file(n, argv[optind + 1], output_data, mxdata, mode, &result);
+    if(clock_gettime(CLOCK_MONOTONIC, &end))
+        ERR("clock_gettime");
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "Counted %zu bytes in %.3f s (%.2f GB/s)\n", total, elapsed, total / elapsed / (1 << 30));
 
-    for(int i = 0; i<n;i++)
+    if(watching)
+        watch_file(n, argv[optind + 1], state_path, output_data, mxdata);
+    if(mode == MODE_BYTES)
+        parent_work(output_data);
+    else
     {
-        pthread_join(tids[i],NULL);
+        counts_print(&result, top);
+        counts_free(&result);
     }
 
-    parent_work(output_data);
-
     for(int i = 0; i<256;i++)
     {
         pthread_mutex_destroy(&mxdata[i]);
         pthread_mutexattr_destroy(&mxattr[i]);
     }
 
-    free(tids);
-    free(data);
     free(mxdata);
     free(mxattr);
-    close(fd);
     close(fd2);
-    munmap(file_memory,st.st_size);
-    munmap(output_data,sizeof(int)*256);
+    munmap(output_data,sizeof(uint64_t)*256);
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
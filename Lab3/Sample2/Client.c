@@ -0,0 +1,215 @@
+#include "Farm.h"
+
+#define POLL_INTERVAL 1000  // microseconds
+
+void usage(char* argv[])
+{
+    printf("%s command - client of the compute farm\n", argv[0]);
+    printf("submit a b samples [exp|sin|square|circle] - enqueue a job and print its id (default integrand: exp)\n");
+    printf("poll id - print the progress of a job, a finished job is printed and removed\n");
+    printf("wait id - wait until a job is finished, then print and remove it\n");
+    printf("list - print all jobs in the table\n");
+    printf("bench jobs samples - submit many small jobs at once and wait for all of them\n");
+    printf("remove - unlink the shared job table\n");
+}
+
+/**
+ * Puts a new job into a free entry of the table.
+ * @return Id of the job, 0 if the table is full.
+ */
+uint64_t submit_job(farm_data* farm, int id, double a, double b, uint64_t samples)
+{
+    uint64_t result = 0;
+    farm_lock(farm);
+    for (int i = 0; i < MAX_JOBS; i++)
+    {
+        farm_job* job = &farm->jobs[i];
+        if (job->state != JOB_FREE)
+            continue;
+        memset(job, 0, sizeof(farm_job));
+        job->id = result = farm->next_id++;
+        job->integrand = id;
+        job->a = a;
+        job->b = b;
+        job->target_samples = samples;
+        clock_gettime(CLOCK_MONOTONIC, &job->submitted);
+        // workers look at jobs without the mutex, so the job becomes visible last
+        __atomic_store_n(&job->state, JOB_RUNNING, __ATOMIC_RELEASE);
+        break;
+    }
+    farm_unlock(farm);
+    return result;
+}
+
+void print_job(farm_job* job)
+{
+    uint64_t done = __atomic_load_n(&job->done, __ATOMIC_ACQUIRE);
+    printf("job %lu: %s on [%f, %f], %lu/%lu samples", job->id, integrand_names[job->integrand], job->a, job->b, done,
+           job->target_samples);
+    if (done == 0)
+    {
+        printf("\n");
+        return;
+    }
+    double sum, sum_squares;
+    __atomic_load(&job->sum, &sum, __ATOMIC_ACQUIRE);
+    __atomic_load(&job->sum_squares, &sum_squares, __ATOMIC_ACQUIRE);
+    double mean = sum / done;
+    double variance = sum_squares / done - mean * mean;
+    double estimate = (job->b - job->a) * mean;
+    printf(", %f +- %.2e, error %.2e", estimate, (job->b - job->a) * sqrt((variance > 0 ? variance : 0) / done),
+           fabs(estimate - exact_integral(job->integrand, job->a, job->b)));
+    if (__atomic_load_n(&job->state, __ATOMIC_ACQUIRE) == JOB_DONE)
+        printf(", done in %.3f s", job->seconds);
+    printf("\n");
+}
+
+/**
+ * Removes the job with this id from the table if it is finished.
+ * @param verbose 0 - print nothing, 1 - print the job once it is finished, 2 - print it anyway
+ * @return State of the job, JOB_FREE if it is unknown.
+ */
+int poll_job(farm_data* farm, uint64_t id, int verbose)
+{
+    farm_lock(farm);
+    int i = farm_find(farm, id), state = JOB_FREE;
+    if (i >= 0)
+    {
+        state = __atomic_load_n(&farm->jobs[i].state, __ATOMIC_ACQUIRE);
+        if ((state == JOB_DONE && verbose) || verbose == 2)
+            print_job(&farm->jobs[i]);
+        if (state == JOB_DONE)
+            __atomic_store_n(&farm->jobs[i].state, JOB_FREE, __ATOMIC_RELEASE);
+    }
+    farm_unlock(farm);
+    return state;
+}
+
+int wait_job(farm_data* farm, uint64_t id)
+{
+    int state;
+    while ((state = poll_job(farm, id, 1)) == JOB_RUNNING)
+        usleep(POLL_INTERVAL);
+    return state;
+}
+
+void list_jobs(farm_data* farm)
+{
+    int workers = 0;
+    farm_lock(farm);
+    for (int i = 0; i < MAX_JOBS; i++)
+    {
+        if (farm->jobs[i].state != JOB_FREE)
+            print_job(&farm->jobs[i]);
+    }
+    for (int i = 0; i < MAX_WORKERS; i++)
+    {
+        if (farm->workers[i].pid && process_alive(farm->workers[i].pid))
+            workers++;
+    }
+    farm_unlock(farm);
+    printf("%d workers\n", workers);
+}
+
+/**
+ * Submits many small jobs over different bounds and integrands, never more than fit into the table,
+ * and waits for all of them. Shows how well the workers keep busy across many short jobs.
+ */
+void bench(farm_data* farm, int jobs, uint64_t samples)
+{
+    uint64_t ids[MAX_JOBS];
+    int submitted = 0, finished = 0, in_table = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (finished < jobs)
+    {
+        while (submitted < jobs && in_table < MAX_JOBS)
+        {
+            int id = submitted % INTEGRAND_COUNT;
+            uint64_t job_id = submit_job(farm, id, -1 - submitted % 3, 1 + submitted % 5, samples);
+            if (!job_id)
+                break;
+            ids[in_table++] = job_id;
+            submitted++;
+        }
+        for (int i = 0; i < in_table;)
+        {
+            if (poll_job(farm, ids[i], 0) != JOB_RUNNING)
+            {
+                ids[i] = ids[--in_table];
+                finished++;
+            }
+            else
+                i++;
+        }
+        usleep(POLL_INTERVAL);
+    }
+    double seconds = elapsed(&start);
+    printf("%d jobs of %lu samples in %.3f s: %.1f jobs/s, %.0f samples/s\n", jobs, samples, seconds, jobs / seconds,
+           jobs * (double)samples / seconds);
+}
+
+int parse_integrand(char* name)
+{
+    for (int i = 0; i < INTEGRAND_COUNT; i++)
+    {
+        if (strcmp(name, integrand_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc < 2)
+    {
+        usage(argv);
+        return EXIT_FAILURE;
+    }
+    if(strcmp(argv[1], "remove") == 0)
+    {
+        if(shm_unlink(FARM_SHM) == -1)
+            ERR("shm_unlink");
+        return EXIT_SUCCESS;
+    }
+
+    farm_data* farm = farm_open();
+    if(strcmp(argv[1], "submit") == 0 && (argc == 5 || argc == 6))
+    {
+        int id = argc == 6 ? parse_integrand(argv[5]) : INTEGRAND_EXP_MINUS_SQUARE;
+        uint64_t samples = strtoull(argv[4], NULL, 10);
+        if(id < 0 || samples == 0)
+        {
+            usage(argv);
+            return EXIT_FAILURE;
+        }
+        uint64_t job_id = submit_job(farm, id, atof(argv[2]), atof(argv[3]), samples);
+        if(!job_id)
+        {
+            fprintf(stderr, "All %d jobs in the table are taken\n", MAX_JOBS);
+            return EXIT_FAILURE;
+        }
+        printf("%lu\n", job_id);
+    }
+    else if((strcmp(argv[1], "poll") == 0 || strcmp(argv[1], "wait") == 0) && argc == 3)
+    {
+        uint64_t id = strtoull(argv[2], NULL, 10);
+        int state = argv[1][0] == 'w' ? wait_job(farm, id) : poll_job(farm, id, 2);
+        if(state == JOB_FREE)
+        {
+            fprintf(stderr, "There is no job %lu\n", id);
+            return EXIT_FAILURE;
+        }
+    }
+    else if(strcmp(argv[1], "list") == 0 && argc == 2)
+        list_jobs(farm);
+    else if(strcmp(argv[1], "bench") == 0 && argc == 4 && atoi(argv[2]) > 0 && strtoull(argv[3], NULL, 10) > 0)
+        bench(farm, atoi(argv[2]), strtoull(argv[3], NULL, 10));
+    else
+    {
+        usage(argv);
+        return EXIT_FAILURE;
+    }
+    farm_close(farm);
+    return EXIT_SUCCESS;
+}
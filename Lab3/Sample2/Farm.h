@@ -0,0 +1,246 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ERR(source) \
+    (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE))
+#define FARM_SHM "/farm_data"
+#define MAX_JOBS 64
+#define MAX_WORKERS 256
+#define CACHE_LINE 64
+#define CLAIM_PENDING -2  // farm_worker.job while a claim is being made, the reaper leaves it alone
+
+/*
+ * Shared job table of the compute farm. Clients submit integration jobs,
+ * any number of Worker processes claim batches of samples from any running job.
+ *
+ * The robust table mutex guards what is rare: submitting and releasing jobs,
+ * registering workers, returning the batches of dead workers and adding the result of a batch,
+ * so a result can never land in a job that took over the entry of the one it was drawn for.
+ * Batches are claimed with a compare-and-swap on the claimed counter, so workers take
+ * the mutex only once per batch and never to get work.
+ */
+
+enum integrand_id
+{
+    INTEGRAND_EXP_MINUS_SQUARE,  // exp(-x*x)
+    INTEGRAND_SIN,
+    INTEGRAND_SQUARE,            // x*x
+    INTEGRAND_HALF_CIRCLE,       // sqrt(1-x*x), 0 outside of [-1,1]
+    INTEGRAND_COUNT
+};
+
+const char* integrand_names[INTEGRAND_COUNT] = {"exp", "sin", "square", "circle"};
+
+enum job_state
+{
+    JOB_FREE,
+    JOB_RUNNING,
+    JOB_DONE
+};
+
+typedef struct
+{
+    uint64_t id;
+    int state;  // enum job_state, FREE <-> RUNNING under the table mutex, RUNNING -> DONE by the last worker
+    int integrand;
+    double a;
+    double b;
+    uint64_t target_samples;
+    uint64_t claimed;  // samples handed out to workers
+    uint64_t done;     // samples already added to sum
+    double sum;        // sum of f(x), updated with a compare-and-swap loop
+    double sum_squares;
+    struct timespec submitted;
+    double seconds;  // from submission to the last batch
+} __attribute__((aligned(CACHE_LINE))) farm_job;
+
+typedef struct
+{
+    pid_t pid;  // 0 marks a free slot
+    int job;    // index of the job of the batch in flight, -1 when there is none or CLAIM_PENDING
+    uint64_t job_id;
+    uint64_t batch;  // samples of the batch in flight
+    uint64_t samples;
+} __attribute__((aligned(CACHE_LINE))) farm_worker;
+
+typedef struct
+{
+    pthread_mutex_t mutex;
+    int initialized;
+    uint64_t next_id;
+    farm_job jobs[MAX_JOBS];
+    farm_worker workers[MAX_WORKERS];
+} farm_data;
+
+double integrand(int id, double x)
+{
+    switch (id)
+    {
+        case INTEGRAND_EXP_MINUS_SQUARE:
+            return exp(-x * x);
+        case INTEGRAND_SIN:
+            return sin(x);
+        case INTEGRAND_SQUARE:
+            return x * x;
+        default:
+            return x > -1 && x < 1 ? sqrt(1 - x * x) : 0;
+    }
+}
+
+double exact_integral(int id, double a, double b)
+{
+    switch (id)
+    {
+        case INTEGRAND_EXP_MINUS_SQUARE:
+            return sqrt(M_PI) / 2 * (erf(b) - erf(a));
+        case INTEGRAND_SIN:
+            return cos(a) - cos(b);
+        case INTEGRAND_SQUARE:
+            return (b * b * b - a * a * a) / 3;
+        default:
+            a = a < -1 ? -1 : a > 1 ? 1 : a;
+            b = b < -1 ? -1 : b > 1 ? 1 : b;
+            return (b * sqrt(1 - b * b) + asin(b) - a * sqrt(1 - a * a) - asin(a)) / 2;
+    }
+}
+
+void atomic_add_double(double* target, double value)
+{
+    double old, sum;
+    __atomic_load(target, &old, __ATOMIC_RELAXED);
+    do
+        sum = old + value;
+    while (!__atomic_compare_exchange(target, &old, &sum, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+double elapsed(struct timespec* since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+/**
+ * Maps the farm segment, creating it on the first call.
+ * The creator initializes the robust mutex, everybody else waits until it is done.
+ */
+farm_data* farm_open()
+{
+    int fd, created = 1;
+    if ((fd = shm_open(FARM_SHM, O_RDWR | O_CREAT | O_EXCL, 0666)) == -1)
+    {
+        if (errno != EEXIST)
+            ERR("shm_open");
+        created = 0;
+        if ((fd = shm_open(FARM_SHM, O_RDWR, 0666)) == -1)
+            ERR("shm_open");
+    }
+    if (created && ftruncate(fd, sizeof(farm_data)) == -1)
+        ERR("ftruncate");
+    struct stat st;
+    while (1)
+    {
+        if (fstat(fd, &st) == -1)
+            ERR("fstat");
+        if (st.st_size >= (off_t)sizeof(farm_data))
+            break;
+        usleep(1000);
+    }
+    farm_data* farm;
+    if ((farm = mmap(NULL, sizeof(farm_data), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        ERR("mmap");
+    close(fd);
+    if (created)
+    {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&farm->mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+        farm->next_id = 1;
+        for (int i = 0; i < MAX_WORKERS; i++)
+            farm->workers[i].job = -1;
+        __atomic_store_n(&farm->initialized, 1, __ATOMIC_RELEASE);
+    }
+    while (!__atomic_load_n(&farm->initialized, __ATOMIC_ACQUIRE))
+        usleep(1000);
+    return farm;
+}
+
+void farm_close(farm_data* farm)
+{
+    munmap(farm, sizeof(farm_data));
+}
+
+// Every write under the mutex leaves the table valid, so a dead owner needs no repair
+void farm_lock(farm_data* farm)
+{
+    int ret = pthread_mutex_lock(&farm->mutex);
+    if (ret == EOWNERDEAD)
+        pthread_mutex_consistent(&farm->mutex);
+    else if (ret != 0)
+        errno = ret, ERR("pthread_mutex_lock");
+}
+
+void farm_unlock(farm_data* farm)
+{
+    pthread_mutex_unlock(&farm->mutex);
+}
+
+int process_alive(pid_t pid)
+{
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+/**
+ * Gives the batches of dead workers back to their jobs and frees their slots.
+ * Call it with the table mutex held.
+ * @return Number of slots freed.
+ */
+int farm_reap(farm_data* farm)
+{
+    int reaped = 0;
+    for (int i = 0; i < MAX_WORKERS; i++)
+    {
+        farm_worker* worker = &farm->workers[i];
+        if (worker->pid == 0 || process_alive(worker->pid))
+            continue;
+        int j = worker->job;  // a pending claim is not recorded, so there is nothing to give back
+        if (j >= 0 && farm->jobs[j].id == worker->job_id && farm->jobs[j].state == JOB_RUNNING)
+        {
+            // clamped at 0, a wrapped counter would stop every later claim and the job would never finish
+            uint64_t claimed = __atomic_load_n(&farm->jobs[j].claimed, __ATOMIC_ACQUIRE), left;
+            do
+                left = claimed > worker->batch ? claimed - worker->batch : 0;
+            while (!__atomic_compare_exchange_n(&farm->jobs[j].claimed, &claimed, left, 1, __ATOMIC_ACQ_REL,
+                                                __ATOMIC_ACQUIRE));
+        }
+        worker->job = -1;
+        worker->pid = 0;
+        reaped++;
+    }
+    return reaped;
+}
+
+// Index of the job with this id, -1 if it is not in the table
+int farm_find(farm_data* farm, uint64_t id)
+{
+    for (int i = 0; i < MAX_JOBS; i++)
+    {
+        if (__atomic_load_n(&farm->jobs[i].state, __ATOMIC_ACQUIRE) != JOB_FREE && farm->jobs[i].id == id)
+            return i;
+    }
+    return -1;
+}
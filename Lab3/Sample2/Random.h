@@ -0,0 +1,48 @@
+#include <stdint.h>
+
+#define LANES 2 //doubles in one SSE2 register, the x86-64 baseline
+
+typedef double v2d __attribute__((vector_size(LANES * sizeof(double))));
+typedef uint64_t v2u __attribute__((vector_size(LANES * sizeof(uint64_t))));
+typedef int64_t v2i __attribute__((vector_size(LANES * sizeof(int64_t))));
+
+// xoshiro256+ with LANES independent streams, one per vector lane
+typedef struct
+{
+    v2u s[4];
+}rng_state;
+
+uint64_t splitmix64(uint64_t* x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+void rng_seed(rng_state* rng, uint64_t seed)
+{
+    for(int i = 0; i < 4; i++)
+        for(int j = 0; j < LANES; j++)
+            rng->s[i][j] = splitmix64(&seed);
+}
+
+static inline v2u rotl(v2u x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+// Uniform doubles in [0, 1), one per lane
+static inline v2d rng_next(rng_state* rng)
+{
+    v2u* s = rng->s;
+    v2u result = s[0] + s[3];
+    v2u t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return __builtin_convertvector(result >> 11, v2d) * 0x1.0p-53;
+}
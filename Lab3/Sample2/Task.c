@@ -11,18 +11,53 @@
 #include <string.h>
 #include <signal.h>
 #include <errno.h>
+#include <time.h>
+#include "Random.h"
 
 #define ERR(source) \
     (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE))
+#define MAX_SLOTS 256
+#define CACHE_LINE 64
+#define Z_95 1.959964 //two-sided 95% normal quantile
+#define REPLICATES 8 //independently shifted copies of the sequence in the target precision mode
+#define T_95_REPLICATES 2.364624 //two-sided 95% Student t quantile with REPLICATES - 1 degrees of freedom
+#define MIN_BATCH 1024
+#define MAX_BATCH (1 << 28)
 volatile __sig_atomic_t last_signal = 0;
+
+// How the points of one batch are chosen
+enum sampling_mode
+{
+    SAMPLING_RANDOM,     //pseudo-random hit-or-miss
+    SAMPLING_HALTON,     //hit-or-miss on the 2D Halton sequence (bases 2 and 3)
+    SAMPLING_SOBOL,      //mean value of f on the 1D Sobol sequence
+    SAMPLING_STRATIFIED  //mean value of f, one jittered point per stratum of the batch
+};
+
+// Totals of one process, written only by that process, so no lock is needed.
+// Slots are never reused, so the last totals of a dead process still count.
+typedef struct
+{
+    pid_t pid;
+    int active; //cleared when the process leaves normally
+    uint64_t total_samples;
+    uint64_t successful_hits;
+    double sum_values[REPLICATES]; //per replicate sum of f(x) (minus the control variate), or of hits for halton
+    double sum_squares; //of the first replicate in the mean value modes
+}__attribute__((aligned(CACHE_LINE))) process_slot;
+
 typedef struct
 {
     float a;
     float b;
-    int total_samples;
-    int successful_hits;
-    int num;
-    pthread_mutex_t mxnum;
+    int slots_used; //guarded by the semaphore
+    int converged; //set by the first process that sees the target precision reached
+    int sampling; //enum sampling_mode, chosen by the first process like a and b
+    int control_variate;
+    int replicates; //1, or REPLICATES for the non random modes with a target precision
+    uint64_t next_index; //first unclaimed index of the quasi-random sequence
+    double shift[REPLICATES][2]; //random shifts of the sequence, shared so the partition stays disjoint
+    process_slot slots[MAX_SLOTS];
 }shm_data;
 
 // Values of this function are in range (0,1]
@@ -55,6 +90,148 @@ int randomize_points(int N, float a, float b)
     return result;
 }
 
+/**
+ * Vectorized exp(-x*x).
+ * exp(y) = 2^k * exp(r) with |r| <= ln(2)/2, exp(r) from a degree 7 Taylor polynomial.
+ * Relative error is below 1e-8 (remainder r^8/8!), values under exp(-700) are flushed to about 0.
+ */
+static inline v2d exp_minus_square(v2d x)
+{
+    const v2d min_y = {-700.0, -700.0};
+    v2d y = -x * x;
+    v2i flush = (v2i)(y < min_y);
+    y = (v2d)(((v2i)y & ~flush) | ((v2i)min_y & flush));
+    v2d kd = __builtin_convertvector(__builtin_convertvector(y * 1.4426950408889634 - 0.5, v2i), v2d);
+    v2d r = y - kd * 0.6931471805599453;
+    v2d p = 1.0 + r * (1.0 + r * (1.0 / 2 + r * (1.0 / 6 + r * (1.0 / 24 + r * (1.0 / 120 + r * (1.0 / 720 + r * (1.0 / 5040)))))));
+    v2i bits = (__builtin_convertvector(kd, v2i) + 1023) << 52;
+    v2d scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+/**
+ * Fast version of randomize_points: LANES samples at a time, no sleeping integrand.
+ * N is rounded up to a multiple of LANES, the number of drawn samples is returned in *samples.
+ * @return Number of points which was hit.
+ */
+int randomize_points_fast(int N, float a, float b, rng_state* rng, int* samples)
+{
+    v2i hits = {0};
+    int i;
+    for (i = 0; i < N; i += LANES)
+    {
+        v2d x = rng_next(rng) * (double)(b - a) + a;
+        v2d y = rng_next(rng);
+        hits -= (v2i)(y <= exp_minus_square(x));  // true lanes are -1
+    }
+    *samples = i;
+    int result = 0;
+    for (int j = 0; j < LANES; j++)
+        result += hits[j];
+    return result;
+}
+
+double integrand(double x, int fast)
+{
+    return fast ? exp(-x * x) : func(x);
+}
+
+// Control variate for the mean value modes, close to exp(-x*x) near 0 and with a known integral
+double control_variate(double x)
+{
+    return 1 / (1 + x * x);
+}
+
+double control_variate_integral(float a, float b)
+{
+    return atan(b) - atan(a);
+}
+
+// Integral of exp(-x*x) from a to b, used to report the real error of the estimate
+double exact_integral(float a, float b)
+{
+    return sqrt(M_PI) / 2 * (erf(b) - erf(a));
+}
+
+// Van der Corput radical inverse of i, the i-th point of the Halton sequence in this base
+double radical_inverse(uint64_t i, int base)
+{
+    double result = 0, digit = 1.0;
+    while (i > 0)
+    {
+        digit /= base;
+        result += digit * (i % base);
+        i /= base;
+    }
+    return result;
+}
+
+// i-th point of the first Sobol dimension, which is the base 2 radical inverse done by reversing bits
+double sobol_point(uint64_t i)
+{
+    i = ((i >> 1) & 0x5555555555555555ULL) | ((i & 0x5555555555555555ULL) << 1);
+    i = ((i >> 2) & 0x3333333333333333ULL) | ((i & 0x3333333333333333ULL) << 2);
+    i = ((i >> 4) & 0x0f0f0f0f0f0f0f0fULL) | ((i & 0x0f0f0f0f0f0f0f0fULL) << 4);
+    i = __builtin_bswap64(i);
+    return (i >> 11) * 0x1.0p-53;
+}
+
+static inline double shifted(double u, double shift)
+{
+    u += shift;
+    return u >= 1 ? u - 1 : u;
+}
+
+/**
+ * Quasi-random and stratified counterpart of randomize_points.
+ * Points first..first+N-1 of the sequence are used, the range is claimed from data->next_index
+ * so cooperating processes never evaluate the same point.
+ * Every point is evaluated once per replicate, each replicate with its own shift (or its own jitter when stratified).
+ * sums[r] gets the hits of replicate r in the hit-or-miss modes, the sum of f(x) (minus the control variate)
+ * in the mean value modes, *sum_squares gets the squares of the first replicate.
+ * @return Number of points which was hit by the first replicate in the hit-or-miss modes, 0 otherwise.
+ */
+int sample_sequence(int N, uint64_t first, shm_data* data, rng_state* rng, int fast, double* sums, double* sum_squares)
+{
+    double a = data->a, b = data->b;
+    int result = 0;
+    *sum_squares = 0;
+    for (int r = 0; r < data->replicates; r++)
+        sums[r] = 0;
+    for (int i = 0; i < N; ++i)
+    {
+        for (int r = 0; r < data->replicates; r++)
+        {
+            double x, value;
+            switch (data->sampling)
+            {
+                case SAMPLING_HALTON:
+                    x = shifted(radical_inverse(first + i, 2), data->shift[r][0]) * (b - a) + a;
+                    if (shifted(radical_inverse(first + i, 3), data->shift[r][1]) <= integrand(x, fast))
+                    {
+                        sums[r]++;
+                        result += r == 0;
+                    }
+                    continue;
+                case SAMPLING_SOBOL:
+                    x = shifted(sobol_point(first + i), data->shift[r][0]) * (b - a) + a;
+                    break;
+                default:
+                    x = (i + rng_next(rng)[0]) / N * (b - a) + a;
+                    break;
+            }
+            value = integrand(x, fast);
+            if (data->control_variate)
+                value -= control_variate(x);
+            sums[r] += value;
+            if (r == 0)
+                *sum_squares += value * value;
+        }
+    }
+    return result;
+}
+
 /**
  * This function calculates approximation of integral from counters of hit and total points.
  * @param total_randomized_points Number of total randomized points.
@@ -69,23 +246,133 @@ double summarize_calculations(uint64_t total_randomized_points, uint64_t hit_poi
 }
 
 /**
- * This function locks mutex and can sometime die (it has 2% chance to die).
- * It cannot die if lock would return an error.
- * It doesn't handle any errors. It's users responsibility.
- * Use it only in STAGE 4.
- *
- * @param mtx Mutex to lock
- * @return Value returned from pthread_mutex_lock.
+ * Standard error of the hit-or-miss estimate (b - a) * p.
+ * Every sample is a Bernoulli trial, so the running variance follows from the totals.
+ */
+double standard_error(uint64_t total_samples, uint64_t hit_points, float a, float b)
+{
+    if (total_samples == 0)
+        return INFINITY;
+    double p = (double)hit_points / total_samples;
+    double variance = p * (1 - p);
+    // no hits or only hits yet, assume the worst case instead of a zero variance
+    if (variance == 0)
+        variance = 0.25;
+    return (b - a) * sqrt(variance / total_samples);
+}
+
+/**
+ * Size of the next batch in the target precision mode. It doubles after each batch,
+ * but never goes beyond this process's share of the samples still predicted to be needed.
  */
-int random_death_lock(pthread_mutex_t* mtx)
+int next_batch_size(int batch, uint64_t total_samples, double half_width, double epsilon, int active)
 {
-    int ret = pthread_mutex_lock(mtx);
-    if (ret)
-        return ret;
+    double needed = total_samples * (half_width / epsilon) * (half_width / epsilon) - total_samples;
+    double share = needed / (active > 0 ? active : 1);
+    double next = 2.0 * batch;
+    if (next > share)
+        next = share;
+    if (next > MAX_BATCH)
+        next = MAX_BATCH;
+    return next < MIN_BATCH ? MIN_BATCH : (int)next;
+}
 
+/**
+ * This function can sometime kill the process (it has 2% chance to die).
+ * Call it after publishing a batch, the published totals stay in the slot.
+ */
+void random_death()
+{
     if (rand() % 50 == 0)
         abort();
-    return ret;
+}
+
+int process_alive(pid_t pid)
+{
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+// Number of processes that joined and neither left nor died
+int count_active(shm_data* data)
+{
+    int active = 0;
+    for (int i = 0; i < data->slots_used; i++)
+    {
+        if (__atomic_load_n(&data->slots[i].active, __ATOMIC_ACQUIRE) && process_alive(data->slots[i].pid))
+            active++;
+    }
+    return active;
+}
+
+// Sums the slots of all processes that ever joined, including the dead ones
+void sum_slots(shm_data* data, uint64_t* total_samples, uint64_t* successful_hits, double* sum_values, double* sum_squares)
+{
+    int used = __atomic_load_n(&data->slots_used, __ATOMIC_ACQUIRE);
+    *total_samples = *successful_hits = 0;
+    *sum_squares = 0;
+    for (int r = 0; r < REPLICATES; r++)
+        sum_values[r] = 0;
+    for (int i = 0; i < used; i++)
+    {
+        double value, square;
+        *successful_hits += __atomic_load_n(&data->slots[i].successful_hits, __ATOMIC_ACQUIRE);
+        *total_samples += __atomic_load_n(&data->slots[i].total_samples, __ATOMIC_ACQUIRE);
+        for (int r = 0; r < REPLICATES; r++)
+        {
+            __atomic_load(&data->slots[i].sum_values[r], &value, __ATOMIC_ACQUIRE);
+            sum_values[r] += value;
+        }
+        __atomic_load(&data->slots[i].sum_squares, &square, __ATOMIC_ACQUIRE);
+        *sum_squares += square;
+    }
+}
+
+int hit_or_miss(int sampling)
+{
+    return sampling == SAMPLING_RANDOM || sampling == SAMPLING_HALTON;
+}
+
+/**
+ * Current estimate of the integral from all slots and the half-width of its 95% confidence interval.
+ * With replicates the estimate is their mean and the interval comes from their spread, which is what
+ * a randomized quasi-random estimate really varies by. With a single replicate the interval is the one
+ * of independent samples, in the quasi-random modes it overestimates the real error by far.
+ */
+void estimate_integral(shm_data* data, uint64_t* total_samples, double* result, double* half_width)
+{
+    uint64_t successful_hits;
+    double sum_values[REPLICATES], sum_squares;
+    sum_slots(data, total_samples, &successful_hits, sum_values, &sum_squares);
+    if (data->sampling == SAMPLING_RANDOM || (data->sampling == SAMPLING_HALTON && data->replicates == 1))
+    {
+        *result = summarize_calculations(*total_samples, successful_hits, data->a, data->b);
+        *half_width = Z_95 * standard_error(*total_samples, successful_hits, data->a, data->b);
+        return;
+    }
+    if (*total_samples == 0)
+    {
+        *result = 0;
+        *half_width = INFINITY;
+        return;
+    }
+    double offset = data->control_variate ? control_variate_integral(data->a, data->b) : 0;
+    if (data->replicates > 1)
+    {
+        double estimates[REPLICATES], mean = 0, variance = 0;
+        for (int r = 0; r < data->replicates; r++)
+            mean += estimates[r] = (data->b - data->a) * sum_values[r] / *total_samples + offset;
+        mean /= data->replicates;
+        for (int r = 0; r < data->replicates; r++)
+            variance += (estimates[r] - mean) * (estimates[r] - mean);
+        variance /= data->replicates - 1;
+        *result = mean;
+        *half_width = T_95_REPLICATES * sqrt(variance / data->replicates);
+        return;
+    }
+    double mean = sum_values[0] / *total_samples;
+    double variance = sum_squares / *total_samples - mean * mean;
+    *result = (data->b - data->a) * mean + offset;
+    *half_width = Z_95 * (data->b - data->a) * sqrt((variance > 0 ? variance : 0) / *total_samples);
 }
 
 int sethandler(void(*f)(int), int sig)
@@ -105,20 +392,61 @@ void sigint_handler(int sig)
 
 void usage(char* argv[])
 {
-    printf("%s a b N - calculating integral with multiple processes\n", argv[0]);
+    printf("%s a b N [fast] [epsilon] [random|halton|sobol|stratified] [cv] - calculating integral with multiple processes\n", argv[0]);
     printf("a - Start of segment for integral (default: -1)\n");
     printf("b - End of segment for integral (default: 1)\n");
     printf("N - Size of batch to calculate before reporting to shared memory (default: 1000)\n");
+    printf("epsilon - run until the 95%% confidence interval half-width is below epsilon, growing N geometrically;\n");
+    printf("          the non random modes then evaluate every point under %d random shifts and take the interval from their spread\n", REPLICATES);
+    printf("fast - use the vectorized kernel with a per-process xoshiro256+ generator instead of rand() and func\n");
+    printf("halton - hit-or-miss on the Halton sequence, sobol - mean value on the Sobol sequence,\n");
+    printf("stratified - mean value with one random point per stratum of every batch (default: random)\n");
+    printf("cv - subtract the control variate 1/(1+x^2) with a known integral, sobol and stratified only\n");
 }
 
 int main(int argc, char* argv[])
 {
-    if(argc != 4)
+    if(argc < 4 || argc > 8)
+    {
         usage(argv);
+        return EXIT_FAILURE;
+    }
     
     float a = atof(argv[1]);
     float b = atof(argv[2]);
     int N = atoi(argv[3]);
+    int fast = 0, sampling = SAMPLING_RANDOM, cv = 0;
+    double epsilon = 0;
+    for(int i = 4; i<argc;i++)
+    {
+        if(strcmp(argv[i], "fast") == 0)
+            fast = 1;
+        else if(strcmp(argv[i], "random") == 0)
+            sampling = SAMPLING_RANDOM;
+        else if(strcmp(argv[i], "halton") == 0)
+            sampling = SAMPLING_HALTON;
+        else if(strcmp(argv[i], "sobol") == 0)
+            sampling = SAMPLING_SOBOL;
+        else if(strcmp(argv[i], "stratified") == 0)
+            sampling = SAMPLING_STRATIFIED;
+        else if(strcmp(argv[i], "cv") == 0)
+            cv = 1;
+        else if((epsilon = atof(argv[i])) <= 0)
+        {
+            usage(argv);
+            return EXIT_FAILURE;
+        }
+    }
+    if(cv && hit_or_miss(sampling))
+    {
+        usage(argv);
+        return EXIT_FAILURE;
+    }
+    rng_state rng;
+    rng_seed(&rng, getpid() ^ ((uint64_t)time(NULL) << 20));
+    srand(getpid());
+    double kernel_time = 0;
+    uint64_t kernel_samples = 0;
 
     if(sethandler(sigint_handler, SIGINT)==-1)
         ERR("sethandler");
@@ -136,71 +464,123 @@ int main(int argc, char* argv[])
     if((sem = sem_open("/semaphore", O_CREAT, 0666, 1))==NULL)
         ERR("sem");
 
-    pthread_mutexattr_t attr;
-    pthread_mutexattr_init(&attr);
-    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
-    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
-
     if(sem_wait(sem) == -1)
         ERR("sem_wait");
     
-    if(data->num == 0)
+    if(count_active(data) == 0)
     {
         data->a = a;
         data->b = b;
-        data->total_samples=0;
-        data->successful_hits = 0;
-        pthread_mutex_init(&data->mxnum, &attr);
+        memset(data->slots, 0, sizeof(data->slots));
+        data->slots_used = 0;
+        data->converged = 0;
+        data->sampling = sampling;
+        data->control_variate = cv;
+        data->next_index = 0;
+        data->replicates = epsilon > 0 && sampling != SAMPLING_RANDOM ? REPLICATES : 1;
+        for (int r = 0; r < REPLICATES; r++)
+        {
+            data->shift[r][0] = rng_next(&rng)[0];
+            data->shift[r][1] = rng_next(&rng)[0];
+        }
     }
-    
-    data->num++;
-    printf("Process %d joined. There are %d active processes.\n", getpid(), data->num);
+    if(data->slots_used == MAX_SLOTS)
+    {
+        fprintf(stderr, "All %d process slots are taken\n", MAX_SLOTS);
+        sem_post(sem);
+        exit(EXIT_FAILURE);
+    }
+    process_slot* slot = &data->slots[data->slots_used];
+    slot->pid = getpid();
+    slot->active = 1;
+    __atomic_store_n(&data->slots_used, data->slots_used + 1, __ATOMIC_RELEASE);
+    printf("Process %d joined. There are %d active processes.\n", getpid(), count_active(data));
     if (sem_post(sem) == -1)
         ERR("sem_post");
 
-    for(int i = 0; i<3;i++)
+    uint64_t my_samples = 0, my_hits = 0;
+    double my_sums[REPLICATES] = {0}, my_squares = 0;
+    struct timespec joined;
+    clock_gettime(CLOCK_MONOTONIC, &joined);
+    for(int i = 0; epsilon > 0 || i<3;i++)
     {
         if(last_signal == SIGINT)
             break;
-        int num_hits = randomize_points(N,data->a,data->b);
+        if(epsilon > 0 && __atomic_load_n(&data->converged, __ATOMIC_ACQUIRE))
+            break;
+        struct timespec start, end;
+        int num_hits, samples = N;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if(data->sampling != SAMPLING_RANDOM)
+        {
+            double sums[REPLICATES], squares;
+            uint64_t first = __atomic_fetch_add(&data->next_index, N, __ATOMIC_RELAXED);
+            num_hits = sample_sequence(N, first, data, &rng, fast, sums, &squares);
+            for (int r = 0; r < data->replicates; r++)
+                my_sums[r] += sums[r];
+            my_squares += squares;
+            kernel_samples += (uint64_t)N * (data->replicates - 1);
+        }
+        else if(fast)
+            num_hits = randomize_points_fast(N,data->a,data->b,&rng,&samples);
+        else
+            num_hits = randomize_points(N,data->a,data->b);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        kernel_time += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        kernel_samples += samples;
 
-        int error;
-        if((error = random_death_lock(&data->mxnum))!=0)
+        my_hits += num_hits;
+        my_samples += samples;
+        __atomic_store_n(&slot->successful_hits, my_hits, __ATOMIC_RELEASE);
+        for (int r = 0; r < data->replicates; r++)
+            __atomic_store(&slot->sum_values[r], &my_sums[r], __ATOMIC_RELEASE);
+        __atomic_store(&slot->sum_squares, &my_squares, __ATOMIC_RELEASE);
+        __atomic_store_n(&slot->total_samples, my_samples, __ATOMIC_RELEASE);
+
+        uint64_t total_samples;
+        double estimate, half_width;
+        estimate_integral(data, &total_samples, &estimate, &half_width);
+        printf("PID %d: batch %d, total samples:%lu, estimate: %f, error: %.2e\n", getpid(), i+1, total_samples,
+               estimate, fabs(estimate - exact_integral(data->a, data->b)));
+        if(epsilon > 0)
         {
-            
-            if (error == EOWNERDEAD)
+            if(half_width < epsilon)
             {
-                pthread_mutex_consistent(&data->mxnum);
-                data->num--;
-            }
-            else
-            {
-                ERR("pthread_mutex_lock");
+                if(!__atomic_exchange_n(&data->converged, 1, __ATOMIC_ACQ_REL))
+                {
+                    clock_gettime(CLOCK_MONOTONIC, &end);
+                    printf("PID %d: %f +- %f after %lu samples, %.3f s\n", getpid(), estimate, half_width, total_samples * data->replicates,
+                           (end.tv_sec - joined.tv_sec) + (end.tv_nsec - joined.tv_nsec) / 1e9);
+                }
+                break;
             }
+            N = next_batch_size(N, total_samples, half_width, epsilon, count_active(data));
+            continue;
         }
-        data->successful_hits += num_hits;
-        data->total_samples +=N;
-        printf("PID %d: batch %d, total samples:%d, total hits: %d\n", getpid(), i+1, data->total_samples, data->successful_hits);
-        if(pthread_mutex_unlock(&data->mxnum)!=0)
-            ERR("pthread_mutex_unlock");
+        random_death();
         sleep(2);
     }
 
+    if(kernel_time > 0)
+        printf("PID %d: %.0f samples/s on one core\n", getpid(), kernel_samples / kernel_time);
+
     if(sem_wait(sem) == -1)
         ERR("sem_wait");
     sleep(2);
-    if(data->num == 1)
+    __atomic_store_n(&slot->active, 0, __ATOMIC_RELEASE);
+    if(count_active(data) == 0)
     {
-        double result = summarize_calculations(data->total_samples, data->successful_hits, data->a,data->b);
+        uint64_t total_samples;
+        double result, half_width;
+        estimate_integral(data, &total_samples, &result, &half_width);
             printf("Result: %f\n", result);
+        printf("Exact: %f, error %.2e after %lu evaluations\n", exact_integral(data->a, data->b),
+               fabs(result - exact_integral(data->a, data->b)), total_samples * data->replicates);
         if(shm_unlink("/output_data")==-1)
             ERR("shm_unlink");
         if(sem_unlink("/semaphore")==-1)
             ERR("sem_unlink");
-        if(pthread_mutexattr_destroy(&attr)==-1)
-            ERR("pthread_mutexattr_destroy");
     }
-    data->num--;
     if(sem_post(sem)==-1)
         ERR("sem_post");
 
@@ -209,4 +589,4 @@ int main(int argc, char* argv[])
     sem_close(sem);
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -0,0 +1,183 @@
+#include "Farm.h"
+#include "Random.h"
+
+#define DEFAULT_BATCH (1 << 16)
+#define IDLE_SLEEP 1000  // microseconds between scans of an idle table
+volatile __sig_atomic_t last_signal = 0;
+
+int sethandler(void(*f)(int), int sig)
+{
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = f;
+    if(sigaction(sig, &act,NULL)==-1)
+        return -1;
+    return 1;
+}
+
+void sigint_handler(int sig)
+{
+    last_signal = sig;
+}
+
+void usage(char* argv[])
+{
+    printf("%s [batch] - compute farm worker, run one per core\n", argv[0]);
+    printf("batch - samples claimed from a job at once (default: %d)\n", DEFAULT_BATCH);
+}
+
+farm_worker* register_worker(farm_data* farm)
+{
+    farm_worker* slot = NULL;
+    farm_lock(farm);
+    farm_reap(farm);
+    for (int i = 0; i < MAX_WORKERS && !slot; i++)
+    {
+        if (farm->workers[i].pid == 0)
+            slot = &farm->workers[i];
+    }
+    if (slot)
+    {
+        slot->pid = getpid();
+        slot->job = -1;
+        slot->samples = 0;
+    }
+    farm_unlock(farm);
+    return slot;
+}
+
+/**
+ * Claims up to batch samples of job j. The slot is marked CLAIM_PENDING during the compare-and-swap
+ * and records the batch only once it is claimed, so farm_reap never gives back samples that were
+ * not taken. The claimed job cannot finish before this batch does, so its id is stable afterwards.
+ * @return Number of claimed samples, 0 if the job needs no more.
+ */
+uint64_t claim_batch(farm_data* farm, farm_worker* slot, int j, uint64_t batch)
+{
+    farm_job* job = &farm->jobs[j];
+    __atomic_store_n(&slot->job, CLAIM_PENDING, __ATOMIC_RELEASE);
+    uint64_t claimed = __atomic_load_n(&job->claimed, __ATOMIC_ACQUIRE), n;
+    do
+    {
+        if (__atomic_load_n(&job->state, __ATOMIC_ACQUIRE) != JOB_RUNNING || claimed >= job->target_samples)
+            return 0;
+        n = job->target_samples - claimed < batch ? job->target_samples - claimed : batch;
+    } while (!__atomic_compare_exchange_n(&job->claimed, &claimed, claimed + n, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    slot->job_id = job->id;
+    slot->batch = n;
+    __atomic_store_n(&slot->job, j, __ATOMIC_RELEASE);
+    return n;
+}
+
+// Samples f on n uniform points of [a, b], LANES at a time
+void run_batch(farm_job* job, uint64_t n, rng_state* rng, double* sum, double* sum_squares)
+{
+    double a = job->a, b = job->b;
+    *sum = *sum_squares = 0;
+    for (uint64_t i = 0; i < n; i += LANES)
+    {
+        v2d x = rng_next(rng) * (b - a) + a;
+        for (int j = 0; j < LANES && i + j < n; j++)
+        {
+            double value = integrand(job->integrand, x[j]);
+            *sum += value;
+            *sum_squares += value * value;
+        }
+    }
+}
+
+/**
+ * Adds the result of a batch to its job. The id check and the adds run under the table mutex,
+ * which the client holds to remove a job, so the entry cannot be handed to a new job in between.
+ */
+void finish_batch(farm_data* farm, farm_worker* slot, int j, uint64_t n, double sum, double sum_squares)
+{
+    farm_job* job = &farm->jobs[j];
+    farm_lock(farm);
+    if (job->id != slot->job_id || job->state != JOB_RUNNING)  // our batch was given back while we were running it
+    {
+        __atomic_store_n(&slot->job, -1, __ATOMIC_RELEASE);
+        farm_unlock(farm);
+        return;
+    }
+    atomic_add_double(&job->sum, sum);
+    atomic_add_double(&job->sum_squares, sum_squares);
+    uint64_t done = __atomic_fetch_add(&job->done, n, __ATOMIC_ACQ_REL);
+    if (done < job->target_samples && done + n >= job->target_samples)
+    {
+        job->seconds = elapsed(&job->submitted);
+        __atomic_store_n(&job->state, JOB_DONE, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&slot->job, -1, __ATOMIC_RELEASE);
+    farm_unlock(farm);
+    slot->samples += n;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc > 2)
+    {
+        usage(argv);
+        return EXIT_FAILURE;
+    }
+    uint64_t batch = DEFAULT_BATCH;
+    if(argc == 2 && (batch = strtoull(argv[1], NULL, 10)) == 0)
+    {
+        usage(argv);
+        return EXIT_FAILURE;
+    }
+    if(sethandler(sigint_handler, SIGINT)==-1)
+        ERR("sethandler");
+
+    rng_state rng;
+    rng_seed(&rng, getpid() ^ ((uint64_t)time(NULL) << 20));
+    farm_data* farm = farm_open();
+    farm_worker* slot = register_worker(farm);
+    if(!slot)
+    {
+        fprintf(stderr, "All %d worker slots are taken\n", MAX_WORKERS);
+        return EXIT_FAILURE;
+    }
+    printf("Worker %d ready\n", getpid());
+
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    double busy = 0;
+    int next = 0;
+    while(last_signal != SIGINT)
+    {
+        // round robin over the table, so one big job does not starve the small ones
+        int j = -1;
+        uint64_t n = 0;
+        for(int k = 0; k < MAX_JOBS && n == 0; k++)
+        {
+            j = (next + k) % MAX_JOBS;
+            n = claim_batch(farm, slot, j, batch);
+        }
+        if(n == 0)
+        {
+            __atomic_store_n(&slot->job, -1, __ATOMIC_RELEASE);
+            farm_lock(farm);
+            farm_reap(farm);
+            farm_unlock(farm);
+            usleep(IDLE_SLEEP);
+            continue;
+        }
+        next = (j + 1) % MAX_JOBS;
+        struct timespec start;
+        double sum, sum_squares;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        run_batch(&farm->jobs[j], n, &rng, &sum, &sum_squares);
+        busy += elapsed(&start);
+        finish_batch(farm, slot, j, n, sum, sum_squares);
+    }
+
+    double total = elapsed(&started);
+    printf("Worker %d: %lu samples, busy %.1f%% of %.1f s, %.0f samples/s while busy\n", getpid(), slot->samples,
+           total > 0 ? 100 * busy / total : 0, total, busy > 0 ? slot->samples / busy : 0);
+    farm_lock(farm);
+    slot->pid = 0;
+    farm_unlock(farm);
+    farm_close(farm);
+    return EXIT_SUCCESS;
+}
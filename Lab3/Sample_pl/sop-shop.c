@@ -3,17 +3,33 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #define SHOP_FILENAME "./shop"
 #define MIN_SHELVES 8
-#define MAX_SHELVES 256
+#define MAX_SHELVES (1 << 30)
+#define MAX_PRINTED_SHELVES 256
 #define MIN_WORKERS 1
 #define MAX_WORKERS 64
+#define STRIPES_PER_WORKER 4
+#define SORT_PHASES 3
+#define SNAPSHOT_RETRIES 100
+#define MAX_DEAD_OWNER_EVENTS 64
+#define MAX_PROFILED_LOCKS (1 << 24)  // profiles of all workers together, in stripes
+#define TOP_CONTENDED 10
+#define SUPERVISOR_REPORT_MS 1000
+#define MANAGER_ROUND_MS 500
 
 #define ERR(source)                                     \
     do                                                  \
@@ -35,19 +51,114 @@
 
 typedef struct sharedData
 {
-    pthread_mutex_t mutexArr[MAX_SHELVES];
     int sorted;
     pthread_mutex_t mxSorted;
     int deadWorkerCount;
     pthread_mutex_t mxDeadWorkersCount;
+    // Adjacent pairs with shopArr[k] > shopArr[k + 1], kept up to date by every swap.
+    // The shelves are a permutation of 1..n, so they are sorted exactly when it is 0.
+    long outOfOrder;
+    // A swap increments swapsStarted before it writes the shelves and swapsFinished after,
+    // a copy taken while both stayed equal is a consistent snapshot
+    unsigned long swapsStarted;
+    unsigned long swapsFinished;
+    int benchmarkSeconds;  // 0 - sort the shop, otherwise swap without sleeping or dying for that long
+    int respawn;           // dead workers are replaced by the supervisor, so they may die in a benchmark too
+    // NULL, or one bit per page of the shop, set by the worker that writes the page and cleared when it is flushed
+    unsigned long* dirtyPages;
+    long pageSize;
+    int flushMs;
+    int shopFd;
+    char* profiles;        // NULL, or a lockProfile_t of profileSize bytes for every worker and the manager
+    size_t profileSize;
+    const char* profileFile;
+    // Shelf i is guarded by stripes[stripe_of(i)]. The table is sized to the workers, not to the shelves,
+    // and several shelves of one swap may share a stripe.
+    int stripeCount;
+    pthread_mutex_t stripes[];
 } sharedData_t;
 
+typedef struct lockStats
+{
+    unsigned long acquisitions;
+    unsigned long contended;  // acquisitions that found the stripe locked
+    unsigned long waitNs;
+    unsigned long holdNs;
+    unsigned long acquiredAt;
+} lockStats_t;
+
+typedef struct deadOwnerEvent
+{
+    unsigned long timeNs;  // CLOCK_REALTIME
+    int stripe;
+} deadOwnerEvent_t;
+
+/*
+ * Lock profile of one process, written only by that process, so the counters need no atomics.
+ * The manager reads all of them once the workers are gone.
+ */
+typedef struct lockProfile
+{
+    pid_t pid;
+    int exited;
+    int eventCount;
+    deadOwnerEvent_t events[MAX_DEAD_OWNER_EVENTS];
+    lockStats_t stripes[];
+} lockProfile_t;
+
+// Profile of the calling process, NULL when profiling is off
+lockProfile_t* profile = NULL;
+// Write-back statistics of the manager
+unsigned long flushedBytes = 0;
+int flushRounds = 0;
+long deviceBytesAtStart = -1;
+unsigned long nextFlushNs = 0;  // CLOCK_MONOTONIC deadline of the next dirty page flush, kept across rounds
+
+size_t shared_size(int stripeCount) { return sizeof(sharedData_t) + stripeCount * sizeof(pthread_mutex_t); }
+
+int stripe_of(sharedData_t* sharedData, int aisle)
+{
+    return (uint32_t)(aisle * 2654435761u) % sharedData->stripeCount;
+}
+
+/*
+ * Sort mode: a sample sort in three phases, every phase is split into one task per worker.
+ * 0 - copy block i of the shop into tmpArr, sort it and take its samples
+ * 1 - find where the buckets (ranges between splitters) start in sorted block i
+ * 2 - merge bucket j of all blocks from tmpArr into its final place in the shop
+ * A task is run under its robust mutex and reads only what the previous phases wrote,
+ * so when a worker dies in the middle of one, whoever finds the dead body runs it again.
+ * Locking the mutex of a task run by someone else waits for it, which is the barrier between phases.
+ */
+typedef struct sortTask
+{
+    pthread_mutex_t mx;
+    int done;
+} sortTask_t;
+
+typedef struct sortData
+{
+    sortTask_t tasks[SORT_PHASES][MAX_WORKERS];
+    int workers;
+    long size;
+    int samples[MAX_WORKERS * MAX_WORKERS];     // workers samples from every block
+    long bounds[MAX_WORKERS][MAX_WORKERS + 1];  // bounds[i][j] - start of bucket j in block i
+    int deadWorkerCount;
+} sortData_t;
+
 void usage(char* program_name)
 {
     fprintf(stderr, "Usage: \n");
-    fprintf(stderr, "\t%s n m\n", program_name);
+    fprintf(stderr, "\t%s [-s] [-p] [-r] [-k stripes] [-b seconds] [-P file] [-f ms] n m\n", program_name);
     fprintf(stderr, "\t  n - number of items (shelves), %d <= n <= %d\n", MIN_SHELVES, MAX_SHELVES);
     fprintf(stderr, "\t  m - number of workers, %d <= m <= %d\n", MIN_WORKERS, MAX_WORKERS);
+    fprintf(stderr, "\t  -s - sort the shelves with a parallel sample sort and compare it with qsort\n");
+    fprintf(stderr, "\t  -p - print a snapshot of the shelves on every manager round\n");
+    fprintf(stderr, "\t  -k - number of shelf locks (default: %d per worker)\n", STRIPES_PER_WORKER);
+    fprintf(stderr, "\t  -b - swap without sleeping or dying for the given time, then report swaps/s\n");
+    fprintf(stderr, "\t  -f - track dirty pages and start writing back only those every ms milliseconds\n");
+    fprintf(stderr, "\t  -r - replace dead workers right away and report the swap rate every second\n");
+    fprintf(stderr, "\t  -P - profile waiting for and holding the stripes, write it to file as CSV at the end\n");
     exit(EXIT_FAILURE);
 }
 
@@ -73,6 +184,11 @@ void shuffle(int* array, int n)
 
 void print_array(int* array, int n)
 {
+    if (n > MAX_PRINTED_SHELVES)
+    {
+        printf("%d shelves, too many to print\n", n);
+        return;
+    }
     for (int i = 0; i < n; ++i)
     {
         printf("%3d ", array[i]);
@@ -80,19 +196,297 @@ void print_array(int* array, int n)
     printf("\n");
 }
 
-void mutex_lock_robust(sharedData_t* sharedData, int aisle)
+unsigned long clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+lockProfile_t* profile_of(sharedData_t* sharedData, int worker)
+{
+    return (lockProfile_t*)(sharedData->profiles + worker * sharedData->profileSize);
+}
+
+void mutex_lock_robust(sharedData_t* sharedData, int stripe)
 {
     int ret;
+    unsigned long start = 0;
     // mx Lock doesn't set errno, it returns the error code instead
-    ret = pthread_mutex_lock(&sharedData->mutexArr[aisle]);
+    if (profile)
+    {
+        start = clock_ns(CLOCK_MONOTONIC);
+        if ((ret = pthread_mutex_trylock(&sharedData->stripes[stripe])) == EBUSY)
+        {
+            profile->stripes[stripe].contended++;
+            ret = pthread_mutex_lock(&sharedData->stripes[stripe]);
+        }
+    }
+    else
+        ret = pthread_mutex_lock(&sharedData->stripes[stripe]);
     if (ret == EOWNERDEAD)
     {
-        printf("[%d] Found a dead body in aisle %d\n", getpid(), aisle);
-        pthread_mutex_lock(&sharedData->mxDeadWorkersCount);
-        sharedData->deadWorkerCount++;
-        pthread_mutex_unlock(&sharedData->mxDeadWorkersCount);
-        pthread_mutex_consistent(&sharedData->mutexArr[aisle]);
+        printf("[%d] Found a dead body in stripe %d\n", getpid(), stripe);
+        pthread_mutex_consistent(&sharedData->stripes[stripe]);
+        if (profile && profile->eventCount < MAX_DEAD_OWNER_EVENTS)
+        {
+            profile->events[profile->eventCount].timeNs = clock_ns(CLOCK_REALTIME);
+            profile->events[profile->eventCount++].stripe = stripe;
+        }
     }
+    if (profile)
+    {
+        lockStats_t* stats = &profile->stripes[stripe];
+        stats->acquiredAt = clock_ns(CLOCK_MONOTONIC);
+        stats->waitNs += stats->acquiredAt - start;
+        stats->acquisitions++;
+    }
+}
+
+void mutex_unlock_robust(sharedData_t* sharedData, int stripe)
+{
+    if (profile)
+        profile->stripes[stripe].holdNs += clock_ns(CLOCK_MONOTONIC) - profile->stripes[stripe].acquiredAt;
+    pthread_mutex_unlock(&sharedData->stripes[stripe]);
+}
+
+void profile_start(sharedData_t* sharedData, int worker)
+{
+    if (!sharedData->profiles)
+        return;
+    profile = profile_of(sharedData, worker);
+    profile->pid = getpid();
+}
+
+int compare_stripe_waits(const void* a, const void* b)
+{
+    unsigned long x = ((const unsigned long*)a)[1], y = ((const unsigned long*)b)[1];
+    return (x < y) - (x > y);
+}
+
+/**
+ * Waits until every worker exited or died, then writes all profiles to profileFile as CSV
+ * and prints the most contended stripes. Rows are lock,process,stripe,acquisitions,contended,wait_ns,hold_ns
+ * for every stripe a process took and dead_owner,process,stripe,time_ns for every dead body found.
+ * Process is the worker index, the manager comes last.
+ */
+void profile_dump(sharedData_t* sharedData, int workersCount)
+{
+    if (!sharedData->profiles)
+        return;
+    profile->exited = 1;
+    for (int w = 0; w < workersCount; w++)
+    {
+        lockProfile_t* p = profile_of(sharedData, w);
+        while (!__atomic_load_n(&p->exited, __ATOMIC_ACQUIRE) && p->pid && kill(p->pid, 0) == 0)
+            msleep(10);
+    }
+    FILE* file = fopen(sharedData->profileFile, "w");
+    if (!file)
+        ERR("fopen");
+    int stripeCount = sharedData->stripeCount;
+    unsigned long(*stripeWaits)[2] = calloc(stripeCount, sizeof(*stripeWaits));
+    if (!stripeWaits)
+        ERR("calloc");
+    fprintf(file, "kind,process,stripe,acquisitions,contended,wait_ns,hold_ns\n");
+    for (int w = 0; w <= workersCount; w++)
+    {
+        lockProfile_t* p = profile_of(sharedData, w);
+        unsigned long acquisitions = 0, contended = 0, waitNs = 0, holdNs = 0;
+        for (int i = 0; i < stripeCount; i++)
+        {
+            lockStats_t* stats = &p->stripes[i];
+            if (!stats->acquisitions)
+                continue;
+            fprintf(file, "lock,%d,%d,%lu,%lu,%lu,%lu\n", w, i, stats->acquisitions, stats->contended, stats->waitNs,
+                    stats->holdNs);
+            stripeWaits[i][0] = i;
+            stripeWaits[i][1] += stats->waitNs;
+            acquisitions += stats->acquisitions;
+            contended += stats->contended;
+            waitNs += stats->waitNs;
+            holdNs += stats->holdNs;
+        }
+        for (int e = 0; e < p->eventCount; e++)
+            fprintf(file, "dead_owner,%d,%d,%lu\n", w, p->events[e].stripe, p->events[e].timeNs);
+        if (acquisitions)
+            printf("[%d] %s %d: %lu locks, %.1f%% contended, waited %.3f s, held %.3f s\n", getpid(),
+                   w < workersCount ? "Worker" : "Manager", w, acquisitions, 100.0 * contended / acquisitions,
+                   waitNs / 1e9, holdNs / 1e9);
+    }
+    fclose(file);
+    qsort(stripeWaits, stripeCount, sizeof(*stripeWaits), compare_stripe_waits);
+    for (int i = 0; i < stripeCount && i < TOP_CONTENDED && stripeWaits[i][1]; i++)
+        printf("[%d] Stripe %lu: waited %.3f s\n", getpid(), stripeWaits[i][0], stripeWaits[i][1] / 1e9);
+    printf("[%d] Lock profile written to %s\n", getpid(), sharedData->profileFile);
+    free(stripeWaits);
+}
+
+void mark_dirty(sharedData_t* sharedData, int aisle)
+{
+    if (!sharedData->dirtyPages)
+        return;
+    long page = aisle * sizeof(int) / sharedData->pageSize;
+    unsigned long* word = &sharedData->dirtyPages[page / 64];
+    unsigned long bit = 1UL << (page % 64);
+    // most pages are already dirty, reading first keeps their cache line shared
+    if (!(__atomic_load_n(word, __ATOMIC_RELAXED) & bit))
+        __atomic_fetch_or(word, bit, __ATOMIC_RELEASE);
+}
+
+long dirty_words(int shopSize, long pageSize) { return ((shopSize * sizeof(int) + pageSize - 1) / pageSize + 63) / 64; }
+
+// Writes back pages [first, last) of the shop, waiting for the disk only if wait is set
+unsigned long flush_range(int* shopArr, int shopSize, sharedData_t* sharedData, long first, long last, int wait)
+{
+    long offset = first * sharedData->pageSize, end = last * sharedData->pageSize;
+    if (end > (long)(shopSize * sizeof(int)))
+        end = shopSize * sizeof(int);
+    if (wait)
+    {
+        if (msync((char*)shopArr + offset, end - offset, MS_SYNC))
+            ERR("msync");
+    }
+    else if (sync_file_range(sharedData->shopFd, offset, end - offset, SYNC_FILE_RANGE_WRITE))
+        ERR("sync_file_range");
+    return end - offset;
+}
+
+/**
+ * Writes back the pages marked dirty since the last call, clearing their bits first,
+ * so a page written again during the flush is flushed next time. Runs of dirty pages go out as one range.
+ * @param wait 0 - only start the write-back (sync_file_range), 1 - msync and wait for it
+ * @return Number of bytes written back.
+ */
+unsigned long flush_dirty(int* shopArr, int shopSize, sharedData_t* sharedData, int wait)
+{
+    unsigned long bytes = 0;
+    long words = dirty_words(shopSize, sharedData->pageSize), first = -1;
+    for (long w = 0; w <= words; w++)
+    {
+        unsigned long bits = w < words ? __atomic_exchange_n(&sharedData->dirtyPages[w], 0, __ATOMIC_ACQ_REL) : 0;
+        if ((bits == 0 && first < 0) || (bits == ~0UL && first >= 0))
+            continue;
+        for (int b = 0; b < 64; b++)
+        {
+            int dirty = bits >> b & 1;
+            if (dirty && first < 0)
+                first = w * 64 + b;
+            else if (!dirty && first >= 0)
+            {
+                bytes += flush_range(shopArr, shopSize, sharedData, first, w * 64 + b, wait);
+                first = -1;
+            }
+        }
+    }
+    return bytes;
+}
+
+/**
+ * Sleeps for one manager round. Without dirty tracking the whole shop is synced first, like it always was,
+ * with it only the dirty pages are flushed every flushMs. The flush deadline carries over from round to round,
+ * so intervals longer than a round or not dividing it are kept too.
+ */
+void manager_round(int* shopArr, int shopSize, sharedData_t* sharedData, int ms)
+{
+    flushRounds++;
+    if (!sharedData->dirtyPages)
+    {
+        msync(shopArr, shopSize * sizeof(int), MS_SYNC);
+        flushedBytes += shopSize * sizeof(int);
+        msleep(ms);
+        return;
+    }
+    unsigned long interval = sharedData->flushMs * 1000000UL, now = clock_ns(CLOCK_MONOTONIC);
+    unsigned long roundEnd = now + ms * 1000000UL;
+    if (!nextFlushNs)
+        nextFlushNs = now + interval;
+    while (nextFlushNs <= roundEnd)
+    {
+        if (nextFlushNs > now)
+            msleep((nextFlushNs - now) / 1000000);
+        flushedBytes += flush_dirty(shopArr, shopSize, sharedData, 0);
+        now = clock_ns(CLOCK_MONOTONIC);
+        // a flush slower than the interval starts the next one a whole interval later instead of piling up
+        nextFlushNs = nextFlushNs + interval > now ? nextFlushNs + interval : now + interval;
+    }
+    if (roundEnd > now)
+        msleep((roundEnd - now) / 1000000);
+}
+
+/**
+ * Bytes written so far to the block device holding the shop, from its sysfs stat file.
+ * msync skips clean pages, so this is what both ways of flushing really cost.
+ * @return -1 if the shop is not on a block device.
+ */
+long device_written_bytes()
+{
+    struct stat st;
+    char path[64];
+    long sectors = -1;
+    if (stat(SHOP_FILENAME, &st))
+        return -1;
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/stat", major(st.st_dev), minor(st.st_dev));
+    FILE* file = fopen(path, "r");
+    if (!file)
+        return -1;
+    // sectors written is the 7th field, sectors are always 512 bytes there
+    if (fscanf(file, "%*u %*u %*u %*u %*u %*u %ld", &sectors) != 1)
+        sectors = -1;
+    fclose(file);
+    return sectors < 0 ? -1 : sectors * 512;
+}
+
+void flush_start() { deviceBytesAtStart = device_written_bytes(); }
+
+void flush_report(int shopSize, double seconds)
+{
+    long deviceBytes = device_written_bytes();
+    printf("[%d] Flushed %lu bytes in %.1f s: %.0f B/s, syncing the whole shop every round covers %.0f B/s\n",
+           getpid(), flushedBytes, seconds, flushedBytes / seconds,
+           (double)flushRounds * shopSize * sizeof(int) / seconds);
+    if (deviceBytesAtStart >= 0 && deviceBytes >= 0)
+        printf("[%d] The device wrote %.0f B/s meanwhile\n", getpid(), (deviceBytes - deviceBytesAtStart) / seconds);
+}
+
+// Number of inverted adjacent pairs among pairs (k, k + 1) for k in pairs, skipping repeats and the ones past the end
+int count_inverted(int* shopArr, int shopSize, int* pairs, int n)
+{
+    int count = 0;
+    for (int k = 0; k < n; k++)
+    {
+        if (pairs[k] < 0 || pairs[k] >= shopSize - 1 || (k > 0 && pairs[k] == pairs[k - 1]))
+            continue;
+        if (shopArr[pairs[k]] > shopArr[pairs[k] + 1])
+            count++;
+    }
+    return count;
+}
+
+/**
+ * Collects the stripes a swap of i < j has to lock to update outOfOrder: those of i and j with their neighbours,
+ * because the pairs (i - 1, i), (i, i + 1), (j - 1, j) and (j, j + 1) change.
+ * They come out sorted and without repeats, so locking them in order keeps the swaps deadlock free
+ * like the i < j rule did for one lock per shelf.
+ * @return Number of stripes written to stripes.
+ */
+int swap_stripes(sharedData_t* sharedData, int i, int j, int shopSize, int stripes[6])
+{
+    int n = 0, aisles[6] = {i - 1, i, i + 1, j - 1, j, j + 1};
+    for (int a = 0; a < 6; a++)
+    {
+        if (aisles[a] < 0 || aisles[a] >= shopSize)
+            continue;
+        int stripe = stripe_of(sharedData, aisles[a]), p = n;
+        while (p > 0 && stripes[p - 1] > stripe)
+            p--;
+        if (p > 0 && stripes[p - 1] == stripe)
+            continue;
+        memmove(stripes + p + 1, stripes + p, (n - p) * sizeof(int));
+        stripes[p] = stripe;
+        n++;
+    }
+    return n;
 }
 
 void child_work(int* shopArr, int shopSize, sharedData_t* sharedData)
@@ -103,14 +497,9 @@ void child_work(int* shopArr, int shopSize, sharedData_t* sharedData)
 
     while (1)
     {
-        // Check if the array is sorted
-        pthread_mutex_lock(&sharedData->mxSorted);
-        if (sharedData->sorted)
-        {
-            pthread_mutex_unlock(&sharedData->mxSorted);
+        // Check if the array is sorted, the flag is only ever set, so no lock is needed to read it
+        if (__atomic_load_n(&sharedData->sorted, __ATOMIC_ACQUIRE))
             break;
-        }
-        pthread_mutex_unlock(&sharedData->mxSorted);
 
         i = rand() % shopSize;
         while ((j = rand() % shopSize) == i)  // j index cannot be the same as i index
@@ -119,123 +508,537 @@ void child_work(int* shopArr, int shopSize, sharedData_t* sharedData)
         if (j < i)
             SWAP(i, j);
 
-        mutex_lock_robust(sharedData, i);
-        mutex_lock_robust(sharedData, j);
+        int stripes[6], locked = swap_stripes(sharedData, i, j, shopSize, stripes);
+        for (int k = 0; k < locked; k++)
+            mutex_lock_robust(sharedData, stripes[k]);
         if (shopArr[i] > shopArr[j])
         {
-            if (rand() % 100 == 0)
+            if ((!sharedData->benchmarkSeconds || sharedData->respawn) && rand() % 100 == 0)
             {
                 printf("[%d] Trips over pallet and dies\n", getpid());
+                // A body holds up to 6 stripes, so counting the bodies found would not count the dead
+                pthread_mutex_lock(&sharedData->mxDeadWorkersCount);
+                sharedData->deadWorkerCount++;
+                pthread_mutex_unlock(&sharedData->mxDeadWorkersCount);
                 abort();
             }
+            int pairs[4] = {i - 1, i, j - 1, j};
+            __atomic_fetch_add(&sharedData->swapsStarted, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            int before = count_inverted(shopArr, shopSize, pairs, 4);
             SWAP(shopArr[i], shopArr[j]);
-            msleep(100);
+            mark_dirty(sharedData, i);
+            mark_dirty(sharedData, j);
+            __atomic_fetch_add(&sharedData->outOfOrder, count_inverted(shopArr, shopSize, pairs, 4) - before,
+                               __ATOMIC_RELAXED);
+            __atomic_fetch_add(&sharedData->swapsFinished, 1, __ATOMIC_RELEASE);
+            if (!sharedData->benchmarkSeconds)
+                msleep(100);
         }
 
-        pthread_mutex_unlock(&sharedData->mutexArr[i]);
-        pthread_mutex_unlock(&sharedData->mutexArr[j]);
+        for (int k = locked - 1; k >= 0; k--)
+            mutex_unlock_robust(sharedData, stripes[k]);
     }
+    if (profile)
+        __atomic_store_n(&profile->exited, 1, __ATOMIC_RELEASE);
 }
 
-void manager_work(int* shopArr, int shopSize, sharedData_t* sharedData, int workersCount)
+/**
+ * Copies the shelves without locking them, retrying while swaps are in progress.
+ * Gives up after SNAPSHOT_RETRIES attempts and takes every lock instead.
+ */
+void snapshot(int* shopArr, int shopSize, sharedData_t* sharedData, int* copy)
 {
-    int sorted = 0;
-    while (!sorted)
+    for (int attempt = 0; attempt < SNAPSHOT_RETRIES; attempt++)
     {
-        msync(shopArr, shopSize * sizeof(int), MS_SYNC);
-
-        for (int i = 0; i < shopSize; i++)
+        unsigned long finished = __atomic_load_n(&sharedData->swapsFinished, __ATOMIC_ACQUIRE);
+        unsigned long started = __atomic_load_n(&sharedData->swapsStarted, __ATOMIC_ACQUIRE);
+        if (started == finished)
         {
-            mutex_lock_robust(sharedData, i);
+            memcpy(copy, shopArr, shopSize * sizeof(int));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&sharedData->swapsStarted, __ATOMIC_RELAXED) == started)
+                return;
         }
+        msleep(1);
+    }
+    for (int i = 0; i < sharedData->stripeCount; i++)
+        mutex_lock_robust(sharedData, i);
+    memcpy(copy, shopArr, shopSize * sizeof(int));
+    for (int i = 0; i < sharedData->stripeCount; i++)
+        mutex_unlock_robust(sharedData, i);
+}
 
-        print_array(shopArr, shopSize);
+double elapsed(struct timespec* since);
 
-        sorted = 1;
-        for (int i = 0; i < shopSize; i++)
-        {
-            if (shopArr[i] != i + 1)
-            {
-                sorted = 0;
-                break;
-            }
-        }
+// Lets the workers swap for benchmarkSeconds, then stops them and reports the swap rate and lock memory
+void benchmark_work(int* shopArr, int shopSize, sharedData_t* sharedData, int workersCount)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    unsigned long startSwaps = __atomic_load_n(&sharedData->swapsFinished, __ATOMIC_RELAXED);
+    flush_start();
+    while (elapsed(&start) < sharedData->benchmarkSeconds)
+        manager_round(shopArr, shopSize, sharedData, MANAGER_ROUND_MS);
+    unsigned long swaps = __atomic_load_n(&sharedData->swapsFinished, __ATOMIC_RELAXED) - startSwaps;
+    double seconds = elapsed(&start);
+    pthread_mutex_lock(&sharedData->mxSorted);
+    sharedData->sorted = 1;
+    pthread_mutex_unlock(&sharedData->mxSorted);
+    printf("[%d] %lu swaps in %.1f s: %.0f swaps/s\n", getpid(), swaps, seconds, swaps / seconds);
+    printf("[%d] %d stripes take %zu bytes, a mutex per shelf would take %zu\n", getpid(), sharedData->stripeCount,
+           sharedData->stripeCount * sizeof(pthread_mutex_t), shopSize * sizeof(pthread_mutex_t));
+    flush_report(shopSize, seconds);
+    profile_dump(sharedData, workersCount);
+    exit(EXIT_SUCCESS);
+}
 
-        for (int i = 0; i < shopSize; i++)
+void manager_work(int* shopArr, int shopSize, sharedData_t* sharedData, int workersCount, int printSnapshots)
+{
+    int sorted = 0;
+    int* copy = NULL;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    flush_start();
+    if (printSnapshots && !(copy = malloc(shopSize * sizeof(int))))
+        ERR("malloc");
+    while (!sorted)
+    {
+        long outOfOrder = __atomic_load_n(&sharedData->outOfOrder, __ATOMIC_ACQUIRE);
+        sorted = outOfOrder == 0;
+        if (printSnapshots)
         {
-            pthread_mutex_unlock(&sharedData->mutexArr[i]);
+            snapshot(shopArr, shopSize, sharedData, copy);
+            print_array(copy, shopSize);
         }
+        printf("[%d] Pairs out of order: %ld\n", getpid(), outOfOrder);
 
         pthread_mutex_lock(&sharedData->mxDeadWorkersCount);
-        // The body is discovered twice, because each worker has two mutexes locked
-        printf("[%d] Workers dead: %d\n", getpid(), sharedData->deadWorkerCount / 2);
-        if (workersCount == sharedData->deadWorkerCount / 2)  // All workers have died
+        printf("[%d] Workers dead: %d\n", getpid(), sharedData->deadWorkerCount);
+        if (!sharedData->respawn && workersCount == sharedData->deadWorkerCount)  // All workers have died
         {
             printf("[%d] All workers died, I hate my job\n", getpid());
             pthread_mutex_unlock(&sharedData->mxDeadWorkersCount);
+            profile_dump(sharedData, workersCount);
             exit(EXIT_SUCCESS);
         }
         pthread_mutex_unlock(&sharedData->mxDeadWorkersCount);
 
-        msleep(500);
+        if (!sorted)
+            manager_round(shopArr, shopSize, sharedData, MANAGER_ROUND_MS);
     }
 
     printf("[%d] The shop shelves are sorted\n", getpid());
+    flush_report(shopSize, elapsed(&start));
     pthread_mutex_lock(&sharedData->mxSorted);
     sharedData->sorted = 1;
     pthread_mutex_unlock(&sharedData->mxSorted);
+    profile_dump(sharedData, workersCount);
     exit(EXIT_SUCCESS);
 }
 
-void createChildren(int workerCount, int* shopArr, int shopSize, sharedData_t* sharedData)
+int compare_ints(const void* a, const void* b)
 {
-    int ret;
-    for (int i = 0; i < workerCount; i++)
+    int x = *(const int*)a, y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+double elapsed(struct timespec* since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+long block_start(sortData_t* sortData, int i) { return sortData->size * i / sortData->workers; }
+
+// First position in sorted array[lo, hi) with a value not less than key
+long lower_bound(int* array, long lo, long hi, int key)
+{
+    while (lo < hi)
     {
-        if (-1 == (ret = fork()))
-            ERR("fork");
+        long mid = lo + (hi - lo) / 2;
+        if (array[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void sort_block(int* shopArr, int* tmpArr, sortData_t* sortData, int i)
+{
+    int m = sortData->workers;
+    long lo = block_start(sortData, i), len = block_start(sortData, i + 1) - lo;
+    memcpy(tmpArr + lo, shopArr + lo, len * sizeof(int));
+    qsort(tmpArr + lo, len, sizeof(int), compare_ints);
+    for (int k = 0; k < m; k++)
+        sortData->samples[i * m + k] = len ? tmpArr[lo + (k + 1) * len / (m + 1)] : shopArr[0];
+}
+
+void split_block(int* tmpArr, sortData_t* sortData, int i)
+{
+    int m = sortData->workers;
+    int* samples = malloc(sizeof(int) * m * m);
+    if (!samples)
+        ERR("malloc");
+    memcpy(samples, sortData->samples, sizeof(int) * m * m);
+    qsort(samples, m * m, sizeof(int), compare_ints);
+    long lo = block_start(sortData, i), hi = block_start(sortData, i + 1);
+    sortData->bounds[i][0] = lo;
+    for (int j = 1; j < m; j++)
+        sortData->bounds[i][j] = lower_bound(tmpArr, lo, hi, samples[j * m]);
+    sortData->bounds[i][m] = hi;
+    free(samples);
+}
 
-        if (ret == 0)  // Child
+void sift_down(int* heap, int heapSize, int* tmpArr, long* pos, int p)
+{
+    for (int c; (c = 2 * p + 1) < heapSize; p = c)
+    {
+        if (c + 1 < heapSize && tmpArr[pos[heap[c + 1]]] < tmpArr[pos[heap[c]]])
+            c++;
+        if (tmpArr[pos[heap[p]]] <= tmpArr[pos[heap[c]]])
+            break;
+        SWAP(heap[p], heap[c]);
+    }
+}
+
+// k-way merge of bucket j of every block with a binary heap of run indices ordered by their heads
+void merge_bucket(int* shopArr, int* tmpArr, sortData_t* sortData, int j)
+{
+    int m = sortData->workers, heap[MAX_WORKERS], heapSize = 0;
+    long pos[MAX_WORKERS], out = 0;
+    for (int i = 0; i < m; i++)
+    {
+        out += sortData->bounds[i][j] - sortData->bounds[i][0];
+        pos[i] = sortData->bounds[i][j];
+        if (pos[i] < sortData->bounds[i][j + 1])
+            heap[heapSize++] = i;
+    }
+    for (int k = heapSize / 2 - 1; k >= 0; k--)
+        sift_down(heap, heapSize, tmpArr, pos, k);
+    while (heapSize)
+    {
+        int i = heap[0];
+        shopArr[out++] = tmpArr[pos[i]++];
+        if (pos[i] == sortData->bounds[i][j + 1])
+            heap[0] = heap[--heapSize];
+        sift_down(heap, heapSize, tmpArr, pos, 0);
+    }
+}
+
+/**
+ * Runs every task of every phase that is not done yet, starting from the worker's own.
+ * @param worker Index of the worker, the parent passes 0 when it finishes the work of the dead
+ * @param mayDie Whether the worker trips over a pallet now and then, like in the swapping mode
+ */
+void sort_work(int* shopArr, int* tmpArr, sortData_t* sortData, int worker, int mayDie)
+{
+    int m = sortData->workers;
+    srand(getpid());
+    for (int phase = 0; phase < SORT_PHASES; phase++)
+    {
+        for (int k = 0; k < m; k++)
         {
-            printf("[%d] Worker reports for a night shift\n", getpid());
-            child_work(shopArr, shopSize, sharedData);
+            int t = (worker + k) % m;
+            sortTask_t* task = &sortData->tasks[phase][t];
+            if (pthread_mutex_lock(&task->mx) == EOWNERDEAD)
+            {
+                printf("[%d] Found a dead body at task %d of phase %d\n", getpid(), t, phase);
+                __atomic_fetch_add(&sortData->deadWorkerCount, 1, __ATOMIC_RELAXED);
+                pthread_mutex_consistent(&task->mx);
+            }
+            if (!task->done)
+            {
+                if (phase == 0)
+                    sort_block(shopArr, tmpArr, sortData, t);
+                else if (phase == 1)
+                    split_block(tmpArr, sortData, t);
+                else
+                    merge_bucket(shopArr, tmpArr, sortData, t);
+                if (mayDie && rand() % 100 == 0)
+                {
+                    printf("[%d] Trips over pallet and dies\n", getpid());
+                    abort();
+                }
+                task->done = 1;
+            }
+            pthread_mutex_unlock(&task->mx);
+        }
+    }
+}
+
+void sort_mode(int* shopArr, long size, int workersCount)
+{
+    struct timespec start;
+    int* copy = malloc(size * sizeof(int));
+    if (!copy)
+        ERR("malloc");
+    memcpy(copy, shopArr, size * sizeof(int));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    qsort(copy, size, sizeof(int), compare_ints);
+    double qsortTime = elapsed(&start);
+    free(copy);
+
+    int* tmpArr = mmap(NULL, size * sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (tmpArr == MAP_FAILED)
+        ERR("mmap");
+    sortData_t* sortData = mmap(NULL, sizeof(sortData_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sortData == MAP_FAILED)
+        ERR("mmap");
+    sortData->workers = workersCount;
+    sortData->size = size;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (int p = 0; p < SORT_PHASES; p++)
+        for (int i = 0; i < workersCount; i++)
+            pthread_mutex_init(&sortData->tasks[p][i].mx, &attr);
+    pthread_mutexattr_destroy(&attr);
 
-            // Cleanup
-            munmap(shopArr, shopSize * sizeof(int));
-            munmap(sharedData, sizeof(sharedData_t));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < workersCount; i++)
+    {
+        int ret;
+        if (-1 == (ret = fork()))
+            ERR("fork");
+        if (ret == 0)
+        {
+            sort_work(shopArr, tmpArr, sortData, i, 1);
             exit(EXIT_SUCCESS);
         }
-        // Parent
     }
+    while (wait(NULL) > 0)
+        ;
+    printf("[%d] Tasks taken over from dead workers: %d\n", getpid(), sortData->deadWorkerCount);
+    for (int i = 0; i < workersCount; i++)
+    {
+        if (!sortData->tasks[SORT_PHASES - 1][i].done)
+        {
+            printf("[%d] All workers died, finishing the sort myself\n", getpid());
+            sort_work(shopArr, tmpArr, sortData, 0, 0);
+            break;
+        }
+    }
+    double sortTime = elapsed(&start);
+
+    for (long i = 0; i < size; i++)
+    {
+        if (shopArr[i] != i + 1)
+        {
+            fprintf(stderr, "Shelf %ld holds %d\n", i, shopArr[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf("qsort on one core: %.3f s, %.1f M items/s\n", qsortTime, size / qsortTime / 1e6);
+    printf("sample sort with %d workers: %.3f s, %.1f M items/s, %.2fx\n", workersCount, sortTime,
+           size / sortTime / 1e6, qsortTime / sortTime);
 
+    for (int p = 0; p < SORT_PHASES; p++)
+        for (int i = 0; i < workersCount; i++)
+            pthread_mutex_destroy(&sortData->tasks[p][i].mx);
+    munmap(sortData, sizeof(sortData_t));
+    munmap(tmpArr, size * sizeof(int));
+}
+
+pid_t spawn_worker(int worker, int* shopArr, int shopSize, sharedData_t* sharedData)
+{
+    pid_t ret;
+    fflush(stdout);  // the child would print whatever the parent has buffered again
+    if (-1 == (ret = fork()))
+        ERR("fork");
+
+    if (ret == 0)  // Child
+    {
+        printf("[%d] Worker reports for a night shift\n", getpid());
+        profile_start(sharedData, worker);
+        child_work(shopArr, shopSize, sharedData);
+
+        // Cleanup
+        munmap(shopArr, shopSize * sizeof(int));
+        munmap(sharedData, shared_size(sharedData->stripeCount));
+        exit(EXIT_SUCCESS);
+    }
+    // Parent
+    return ret;
+}
+
+void createChildren(int workerCount, int* shopArr, int shopSize, sharedData_t* sharedData, int printSnapshots,
+                    pid_t* workerPids)
+{
+    int ret;
+    for (int i = 0; i < workerCount; i++)
+        workerPids[i] = spawn_worker(i, shopArr, shopSize, sharedData);
+
+    fflush(stdout);
     if (-1 == (ret = fork()))
         ERR("fork");
     if (ret == 0)  // Manager
     {
         printf("[%d] Manager reports for a night shift\n", getpid());
-        manager_work(shopArr, shopSize, sharedData, workerCount);
+        profile_start(sharedData, workerCount);
+        if (sharedData->benchmarkSeconds)
+            benchmark_work(shopArr, shopSize, sharedData, workerCount);
+        manager_work(shopArr, shopSize, sharedData, workerCount, printSnapshots);
 
         // Cleanup
         munmap(shopArr, shopSize * sizeof(int));
-        munmap(sharedData, sizeof(sharedData_t));
+        munmap(sharedData, shared_size(sharedData->stripeCount));
         exit(EXIT_SUCCESS);
     }
 }
 
+// Takes every stripe left behind by a dead owner, so the next worker does not have to
+int repair_stripes(sharedData_t* sharedData)
+{
+    int repaired = 0;
+    for (int i = 0; i < sharedData->stripeCount; i++)
+    {
+        int ret = pthread_mutex_trylock(&sharedData->stripes[i]);
+        if (ret == EBUSY)
+            continue;
+        if (ret == EOWNERDEAD)
+        {
+            pthread_mutex_consistent(&sharedData->stripes[i]);
+            repaired++;
+        }
+        pthread_mutex_unlock(&sharedData->stripes[i]);
+    }
+    return repaired;
+}
+
+int pidfd_open(pid_t pid)
+{
+    return syscall(SYS_pidfd_open, pid, 0);
+}
+
+void watch_worker(int epollFd, pid_t pid, int worker, int* pidfds)
+{
+    struct epoll_event event = {.events = EPOLLIN, .data.u32 = worker};
+    if ((pidfds[worker] = pidfd_open(pid)) == -1)
+        ERR("pidfd_open");
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, pidfds[worker], &event) == -1)
+        ERR("epoll_ctl");
+}
+
+/**
+ * Holds a pidfd of every worker and waits on all of them with epoll.
+ * A worker killed by a signal is replaced at once under the same index, after its stripes are repaired.
+ * Every SUPERVISOR_REPORT_MS it prints the swap rate, so the capacity can be watched over time.
+ * Returns when every worker has left on its own, which they do once the shop is sorted.
+ */
+void supervise(int* shopArr, int shopSize, sharedData_t* sharedData, int workersCount, pid_t* workerPids)
+{
+    int epollFd, pidfds[MAX_WORKERS], alive = workersCount, respawned = 0, reports = 0;
+    struct epoll_event events[MAX_WORKERS];
+    if ((epollFd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+        ERR("epoll_create1");
+    for (int i = 0; i < workersCount; i++)
+        watch_worker(epollFd, workerPids[i], i, pidfds);
+
+    struct timespec start, lastReport;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    lastReport = start;
+    unsigned long startSwaps = 0, lastSwaps = 0;
+    int lastRespawned = 0;
+    while (alive > 0)
+    {
+        int ready = epoll_wait(epollFd, events, MAX_WORKERS, SUPERVISOR_REPORT_MS);
+        if (ready == -1 && errno != EINTR)
+            ERR("epoll_wait");
+        for (int e = 0; e < ready; e++)
+        {
+            int worker = events[e].data.u32, status;
+            if (waitpid(workerPids[worker], &status, 0) == -1)
+                ERR("waitpid");
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, pidfds[worker], NULL);
+            close(pidfds[worker]);
+            if (!WIFSIGNALED(status) || __atomic_load_n(&sharedData->sorted, __ATOMIC_ACQUIRE))
+            {
+                alive--;
+                continue;
+            }
+            int repaired = repair_stripes(sharedData);
+            workerPids[worker] = spawn_worker(worker, shopArr, shopSize, sharedData);
+            watch_worker(epollFd, workerPids[worker], worker, pidfds);
+            respawned++;
+            printf("[%d] Worker %d died, repaired %d stripes, replaced by %d\n", getpid(), worker, repaired,
+                   workerPids[worker]);
+        }
+        if (elapsed(&lastReport) * 1000 >= SUPERVISOR_REPORT_MS)
+        {
+            unsigned long swaps = __atomic_load_n(&sharedData->swapsFinished, __ATOMIC_RELAXED);
+            printf("[%d] %.0f swaps/s, %d workers respawned\n", getpid(), (swaps - lastSwaps) / elapsed(&lastReport),
+                   respawned - lastRespawned);
+            if (reports++ == 0)
+                startSwaps = swaps;  // the first second includes forking the workers
+            lastSwaps = swaps;
+            lastRespawned = respawned;
+            clock_gettime(CLOCK_MONOTONIC, &lastReport);
+        }
+    }
+    double seconds = elapsed(&start);
+    printf("[%d] Sustained %.0f swaps/s over %.1f s, %d workers respawned\n", getpid(),
+           reports > 1 ? (lastSwaps - startSwaps) / (seconds - SUPERVISOR_REPORT_MS / 1000.0) : lastSwaps / seconds,
+           seconds, respawned);
+    close(epollFd);
+}
+
 int main(int argc, char** argv)
 {
-    if (argc != 3)
+    int c, sortMode = 0, printSnapshots = 0, stripeCount = 0, benchmarkSeconds = 0, respawn = 0, flushMs = 0;
+    const char* profileFile = NULL;
+    while ((c = getopt(argc, argv, "sprk:b:P:f:")) != -1)
+    {
+        switch (c)
+        {
+            case 's':
+                sortMode = 1;
+                break;
+            case 'p':
+                printSnapshots = 1;
+                break;
+            case 'r':
+                respawn = 1;
+                break;
+            case 'k':
+                if ((stripeCount = atoi(optarg)) <= 0)
+                    usage(argv[0]);
+                break;
+            case 'b':
+                if ((benchmarkSeconds = atoi(optarg)) <= 0)
+                    usage(argv[0]);
+                break;
+            case 'P':
+                profileFile = optarg;
+                break;
+            case 'f':
+                if ((flushMs = atoi(optarg)) <= 0)
+                    usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2)
         usage(argv[0]);
-    int productsCount, workersCount;
+    long productsCount;
+    int workersCount;
 
-    productsCount = atoi(argv[1]);
-    workersCount = atoi(argv[2]);
+    productsCount = atol(argv[optind]);
+    workersCount = atoi(argv[optind + 1]);
 
     if (productsCount < MIN_SHELVES || productsCount > MAX_SHELVES)
         usage(argv[0]);
 
     if (workersCount < MIN_WORKERS || workersCount > MAX_WORKERS)
         usage(argv[0]);
+    if (!stripeCount)
+        stripeCount = workersCount * STRIPES_PER_WORKER;
+    if (profileFile && (long)stripeCount * (workersCount + 1) > MAX_PROFILED_LOCKS)
+        usage(argv[0]);
 
     int shopFd;
     if (-1 == (shopFd = open(SHOP_FILENAME, O_CREAT | O_RDWR | O_TRUNC, 0666)))
@@ -246,7 +1049,8 @@ int main(int argc, char** argv)
 
     int* shopArr;
     shopArr = mmap(NULL, productsCount * sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED, shopFd, 0);
-    close(shopFd);  // We can close the file as soon as we map
+    if (!flushMs)
+        close(shopFd);  // We can close the file as soon as we map, unless the manager needs it for sync_file_range
 
     if (shopArr == MAP_FAILED)
         ERR("mmap");
@@ -257,9 +1061,34 @@ int main(int argc, char** argv)
     }
 
     sharedData_t* sharedData =
-        mmap(NULL, sizeof(sharedData_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        mmap(NULL, shared_size(stripeCount), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sharedData == MAP_FAILED)
+        ERR("mmap");
     sharedData->deadWorkerCount = 0;
     sharedData->sorted = 0;
+    sharedData->stripeCount = stripeCount;
+    sharedData->benchmarkSeconds = benchmarkSeconds;
+    sharedData->respawn = respawn;
+    if (flushMs)
+    {
+        sharedData->flushMs = flushMs;
+        sharedData->shopFd = shopFd;
+        sharedData->pageSize = sysconf(_SC_PAGESIZE);
+        sharedData->dirtyPages = mmap(NULL, dirty_words(productsCount, sharedData->pageSize) * sizeof(unsigned long),
+                                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (sharedData->dirtyPages == MAP_FAILED)
+            ERR("mmap");
+    }
+    sharedData->profileFile = profileFile;
+    if (profileFile)
+    {
+        // every profile starts on its own cache line
+        sharedData->profileSize = (sizeof(lockProfile_t) + stripeCount * sizeof(lockStats_t) + 63) / 64 * 64;
+        sharedData->profiles = mmap(NULL, sharedData->profileSize * (workersCount + 1), PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (sharedData->profiles == MAP_FAILED)
+            ERR("mmap");
+    }
 
     pthread_mutexattr_t attr;
     pthread_mutexattr_init(&attr);
@@ -269,38 +1098,60 @@ int main(int argc, char** argv)
     pthread_mutex_init(&sharedData->mxSorted, &attr);
     pthread_mutex_init(&sharedData->mxDeadWorkersCount, &attr);
 
-    for (int i = 0; i < MAX_SHELVES; i++)
+    for (int i = 0; i < stripeCount; i++)
     {
-        pthread_mutex_init(&sharedData->mutexArr[i], &attr);
+        pthread_mutex_init(&sharedData->stripes[i], &attr);
     }
 
     // We may destroy the attribute structure right away
     pthread_mutexattr_destroy(&attr);
 
-    if (sharedData == MAP_FAILED)
-        ERR("mmap");
-
     shuffle(shopArr, productsCount);
-    print_array(shopArr, productsCount);
-    createChildren(workersCount, shopArr, productsCount, sharedData);
+    if (sortMode)
+        sort_mode(shopArr, productsCount, workersCount);
+    else
+    {
+        print_array(shopArr, productsCount);
+        for (int i = 0; i < productsCount - 1; i++)
+        {
+            if (shopArr[i] > shopArr[i + 1])
+                sharedData->outOfOrder++;
+        }
+        pid_t workerPids[MAX_WORKERS];
+        createChildren(workersCount, shopArr, productsCount, sharedData, printSnapshots, workerPids);
+        if (respawn)
+            supervise(shopArr, productsCount, sharedData, workersCount, workerPids);
 
-    while (wait(NULL) > 0)
-        ;
+        while (wait(NULL) > 0)
+            ;
 
-    print_array(shopArr, productsCount);
+        print_array(shopArr, productsCount);
+    }
     printf("Night shift in Bitronka is over\n");
 
     // Cleanup
-    for (int i = 0; i < MAX_SHELVES; i++)
+    for (int i = 0; i < stripeCount; i++)
     {
-        pthread_mutex_destroy(&sharedData->mutexArr[i]);
+        pthread_mutex_destroy(&sharedData->stripes[i]);
     }
     pthread_mutex_destroy(&sharedData->mxSorted);
     pthread_mutex_destroy(&sharedData->mxDeadWorkersCount);
 
     // We need to sync to ensure that the contents actually get written back
-    msync(shopArr, productsCount * sizeof(int), MS_SYNC);
-    munmap(sharedData, sizeof(sharedData_t));
+    if (flushMs)
+    {
+        flush_dirty(shopArr, productsCount, sharedData, 1);
+        // pages flushed earlier may still be under the write-back sync_file_range started, wait for them too
+        if (fdatasync(shopFd))
+            ERR("fdatasync");
+        munmap(sharedData->dirtyPages, dirty_words(productsCount, sharedData->pageSize) * sizeof(unsigned long));
+        close(shopFd);
+    }
+    else
+        msync(shopArr, productsCount * sizeof(int), MS_SYNC);
+    if (profileFile)
+        munmap(sharedData->profiles, sharedData->profileSize * (workersCount + 1));
+    munmap(sharedData, shared_size(stripeCount));
     munmap(shopArr, productsCount * sizeof(int));
     exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,248 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef ERR
+#define ERR(source) \
+    (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE))
+#endif
+
+#define LOG_MAGIC 0x31474f4c4f4c4f53ULL
+#define LOG_DATA 4096            //records start one page into the file
+#define LOG_EXTENT (4 << 20)     //the file grows by whole extents
+#define LOG_SYNC_MS 100          //how often an appending process schedules writeback
+#define LOG_ALIGN 8
+
+/*
+ * Append-only log in a memory mapped file, shared by any number of processes.
+ * An append reserves space by bumping the tail in the header with one atomic add,
+ * so writers never wait for each other unless the file has to grow.
+ * Growing takes the robust mutex in the header, extends the file by whole extents
+ * and every process remaps it on its own once a reservation lands past its mapping.
+ */
+
+typedef struct
+{
+    uint64_t magic;
+    int initialized;
+    pthread_mutex_t grow_mutex;
+    uint64_t tail;  //bytes reserved after LOG_DATA
+} log_header;
+
+// A record is complete once ready is set, length is written before the data so readers can skip it
+typedef struct
+{
+    uint32_t length;
+    uint32_t ready;
+    char data[];
+} log_record;
+
+// Per process view of the log
+typedef struct
+{
+    int fd;
+    char* base;
+    size_t mapped;
+    uint64_t synced;  //end of the part of the file already handed to msync
+    struct timespec last_sync;
+} mlog;
+
+log_header* log_head(mlog* log)
+{
+    return (log_header*)log->base;
+}
+
+uint64_t log_record_size(uint32_t length)
+{
+    return (sizeof(log_record) + length + LOG_ALIGN - 1) & ~(uint64_t)(LOG_ALIGN - 1);
+}
+
+off_t log_file_size(mlog* log)
+{
+    struct stat st;
+    if(fstat(log->fd, &st) == -1)
+        ERR("fstat");
+    return st.st_size;
+}
+
+// Extends the mapping of this process over the whole file
+void log_remap(mlog* log)
+{
+    size_t size = log_file_size(log);
+    if(size <= log->mapped)
+        return;
+    char* base;
+    if((base = mremap(log->base, log->mapped, size, MREMAP_MAYMOVE)) == MAP_FAILED)
+        ERR("mremap");
+    log->base = base;
+    log->mapped = size;
+}
+
+/**
+ * Makes the file at least end bytes long, rounded up to whole extents.
+ * Only one process grows the file at a time, the others find it already big enough.
+ */
+void log_grow(mlog* log, uint64_t end)
+{
+    log_header* header = log_head(log);
+    int ret = pthread_mutex_lock(&header->grow_mutex);
+    if(ret == EOWNERDEAD)  //the file size is the only state, a half done grow is simply repeated
+        pthread_mutex_consistent(&header->grow_mutex);
+    else if(ret != 0)
+        errno = ret, ERR("pthread_mutex_lock");
+    off_t size = log_file_size(log);
+    if((uint64_t)size < end)
+    {
+        off_t new_size = (end + LOG_EXTENT - 1) / LOG_EXTENT * LOG_EXTENT;
+        // fallocate reserves the blocks up front, so a full disk fails here and not with SIGBUS in a writer
+        if(fallocate(log->fd, 0, size, new_size - size) == -1)
+        {
+            if(errno != EOPNOTSUPP)
+                ERR("fallocate");
+            if(ftruncate(log->fd, new_size) == -1)
+                ERR("ftruncate");
+        }
+    }
+    pthread_mutex_unlock(&header->grow_mutex);
+    log_remap(log);
+}
+
+/**
+ * Opens the log at path, creating it when it does not exist.
+ * The creator initializes the header, everybody else waits until it is done.
+ * A log opened before fork can be used by the children as it is.
+ */
+void log_open(mlog* log, const char* path)
+{
+    int created = 1;
+    if((log->fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0666)) == -1)
+    {
+        if(errno != EEXIST)
+            ERR("open");
+        created = 0;
+        if((log->fd = open(path, O_RDWR)) == -1)
+            ERR("open");
+    }
+    if(created && ftruncate(log->fd, LOG_EXTENT) == -1)
+        ERR("ftruncate");
+    while((log->mapped = log_file_size(log)) < LOG_DATA)
+        usleep(1000);
+    if((log->base = mmap(NULL, log->mapped, PROT_READ | PROT_WRITE, MAP_SHARED, log->fd, 0)) == MAP_FAILED)
+        ERR("mmap");
+    log_header* header = log_head(log);
+    if(created)
+    {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&header->grow_mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+        header->magic = LOG_MAGIC;
+        __atomic_store_n(&header->initialized, 1, __ATOMIC_RELEASE);
+    }
+    while(!__atomic_load_n(&header->initialized, __ATOMIC_ACQUIRE))
+        usleep(1000);
+    if(header->magic != LOG_MAGIC)
+    {
+        fprintf(stderr, "%s is not a log\n", path);
+        exit(EXIT_FAILURE);
+    }
+    log->synced = LOG_DATA;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &log->last_sync);
+}
+
+// Schedules writeback of everything appended since the last call, at most every LOG_SYNC_MS
+void log_sync(mlog* log, uint64_t end, int flags)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    if(flags == MS_ASYNC && (now.tv_sec - log->last_sync.tv_sec) * 1000 + (now.tv_nsec - log->last_sync.tv_nsec) / 1000000 < LOG_SYNC_MS)
+        return;
+    log->last_sync = now;
+    uint64_t start = log->synced & ~(uint64_t)(LOG_DATA - 1);
+    if(end > log->mapped)
+        end = log->mapped;
+    if(end > start && msync(log->base + start, end - start, flags))
+        ERR("msync");
+    log->synced = end;
+}
+
+/**
+ * Appends one record of length bytes.
+ * @return Offset of the record in the file.
+ */
+uint64_t log_append(mlog* log, const void* data, uint32_t length)
+{
+    uint64_t size = log_record_size(length);
+    uint64_t offset = LOG_DATA + __atomic_fetch_add(&log_head(log)->tail, size, __ATOMIC_ACQ_REL);
+    if(offset + size > log->mapped)
+    {
+        log_remap(log);
+        if(offset + size > log->mapped)
+            log_grow(log, offset + size);
+    }
+    log_record* record = (log_record*)(log->base + offset);
+    record->length = length;
+    memcpy(record->data, data, length);
+    __atomic_store_n(&record->ready, 1, __ATOMIC_RELEASE);
+    log_sync(log, offset + size, MS_ASYNC);
+    return offset;
+}
+
+int log_printf(mlog* log, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+int log_printf(mlog* log, const char* format, ...)
+{
+    char buf[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    if(length < 0)
+        return length;
+    if(length >= (int)sizeof(buf))
+        length = sizeof(buf) - 1;
+    log_append(log, buf, length);
+    return length;
+}
+
+/**
+ * Returns the record at *offset and moves *offset past it.
+ * @return NULL at the end of the log. A record that is reserved but not written yet
+ * (its writer is still copying or died) is returned with ready == 0.
+ */
+log_record* log_next(mlog* log, uint64_t* offset)
+{
+    uint64_t tail = LOG_DATA + __atomic_load_n(&log_head(log)->tail, __ATOMIC_ACQUIRE);
+    if(*offset < LOG_DATA)
+        *offset = LOG_DATA;
+    if(*offset >= tail)
+        return NULL;
+    if(tail > log->mapped)
+        log_remap(log);
+    log_record* record = (log_record*)(log->base + *offset);
+    uint32_t length = __atomic_load_n(&record->length, __ATOMIC_ACQUIRE);
+    if(length == 0 && !__atomic_load_n(&record->ready, __ATOMIC_ACQUIRE))
+        return NULL;  //the writer has not even stored the length, nothing after it can be found
+    *offset += log_record_size(length);
+    return record;
+}
+
+// Writes back the whole log and unmaps it, the file keeps its preallocated extent
+void log_close(mlog* log)
+{
+    log_sync(log, LOG_DATA + __atomic_load_n(&log_head(log)->tail, __ATOMIC_ACQUIRE), MS_SYNC);
+    if(munmap(log->base, log->mapped))
+        ERR("munmap");
+    close(log->fd);
+}
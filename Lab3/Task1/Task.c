@@ -1,40 +1,88 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/futex.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #define ERR(source) \
     (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
+#include "Log.h"
 #define ITERATIONS 1000
-#define NUM 8
+#define LOG_FILE "./log.bin"
+#define BOARD_SIZE 1024 //jobs on the board at once, a power of two
+
+typedef struct
+{
+    int iterations;
+    unsigned int seed;
+    int hits;
+    uint32_t done; //number of the job on the board plus one, set once hits is written
+}job;
+
+/*
+ * Job board of the persistent mode. The parent posts jobs into a ring and bumps submitted,
+ * workers claim them by bumping claimed, mark the slot done and bump completed.
+ * Jobs finish out of order, so the parent reads and reuses a slot only once it is marked done.
+ * The three counters double as futex words: workers sleep on submitted, the parent on completed.
+ */
+typedef struct
+{
+    uint32_t submitted;
+    uint32_t claimed;
+    uint32_t completed;
+    uint32_t target; //completed count the parent is waiting for
+    uint32_t stop;
+    job jobs[BOARD_SIZE];
+}job_board;
 
 void usage(char* pname)
 {
-    fprintf(stderr, "USAGE%s\n", pname);
+    fprintf(stderr, "USAGE: %s n [jobs [iterations]]\n", pname);
+    fprintf(stderr, "       %s n log appends\n", pname);
+    fprintf(stderr, "n - number of worker processes, 1 <= n <= 30\n");
+    fprintf(stderr, "jobs - keep n workers running and have them do this many estimates from a shared job board\n");
+    fprintf(stderr, "iterations - points per estimate in that mode (default: %d)\n", ITERATIONS);
+    fprintf(stderr, "log appends - benchmark %s with n writers appending this many records each\n", LOG_FILE);
     exit(EXIT_FAILURE);
 }
 
-void child_work(int n, float* data, char* log)
+int futex_wait(uint32_t* addr, uint32_t value)
+{
+    return syscall(SYS_futex, addr, FUTEX_WAIT, value, NULL, NULL, 0);
+}
+
+int futex_wake(uint32_t* addr, int count)
+{
+    return syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+int count_hits(int iterations, unsigned int* seed)
 {
-    srand(getpid());
     int num = 0;
-    for(int i = 0; i<ITERATIONS;i++)
+    for(int i = 0; i<iterations;i++)
     {
-        double x = (double)rand() / RAND_MAX;
-        double y = (double)rand() / RAND_MAX;
+        double x = (double)rand_r(seed) / RAND_MAX;
+        double y = (double)rand_r(seed) / RAND_MAX;
         if(x*x + y*y<=1.0)
             num++;
     }
-    data[n] = (float)num / ITERATIONS;
-    char buf[NUM+1];
+    return num;
+}
 
-    snprintf(buf, NUM + 1, "%7.5f\n", data[n]*4.0f); //formats data into 7-width line + \n
-    memcpy(log + n*NUM, buf, NUM); //copies the buf content into the log memory location at the specified offset
+void child_work(int n, float* data, mlog* log)
+{
+    unsigned int seed = getpid();
+    int num = count_hits(ITERATIONS, &seed);
+    data[n] = (float)num / ITERATIONS;
+    log_printf(log, "%d %d %7.5f\n", n, getpid(), data[n]*4.0f);
     exit(EXIT_SUCCESS);
 }
 
@@ -43,9 +91,10 @@ void parent_work(int n, float* data)
     pid_t pid;
     double sum = 0.0;
 
+    // every child has to finish writing data before it is summed, so block until they are all gone
     for(int i = 0; i<n;i++)
     {
-        pid = waitpid(0,NULL,WNOHANG);
+        pid = waitpid(0,NULL,0);
         if(pid==-1)
         {
             if(errno == ECHILD)
@@ -60,7 +109,7 @@ void parent_work(int n, float* data)
     printf("PI is approximately %f\n", sum*4);
 }
 
-void create_children(int n, float* data, char* log)
+void create_children(int n, float* data, mlog* log)
 {
     for(int i = 0; i<n;i++)
     {
@@ -72,40 +121,204 @@ void create_children(int n, float* data, char* log)
     }
 }
 
+/**
+ * Takes jobs off the board until the parent sets stop.
+ * A worker with nothing to claim sleeps on submitted, the one completing the job the parent waits for wakes it.
+ */
+void pool_worker(job_board* board)
+{
+    while(1)
+    {
+        //claimed first: submitted only grows, so a later load of it is never behind claimed
+        //and the compare-and-swap below can only take a job that was already posted
+        uint32_t claimed = __atomic_load_n(&board->claimed, __ATOMIC_ACQUIRE);
+        uint32_t submitted = __atomic_load_n(&board->submitted, __ATOMIC_ACQUIRE);
+        if((int32_t)(submitted - claimed) <= 0)
+        {
+            if(__atomic_load_n(&board->stop, __ATOMIC_ACQUIRE))
+                exit(EXIT_SUCCESS);
+            futex_wait(&board->submitted, submitted);
+            continue;
+        }
+        if(!__atomic_compare_exchange_n(&board->claimed, &claimed, claimed + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            continue;
+        job* j = &board->jobs[claimed % BOARD_SIZE];
+        unsigned int seed = j->seed;
+        int hits = count_hits(j->iterations, &seed);
+        j->hits = hits;
+        __atomic_store_n(&j->done, claimed + 1, __ATOMIC_RELEASE);
+        if(__atomic_add_fetch(&board->completed, 1, __ATOMIC_SEQ_CST) == __atomic_load_n(&board->target, __ATOMIC_SEQ_CST))
+            futex_wake(&board->completed, 1);
+    }
+}
+
+// Blocks until at least target jobs are completed
+void wait_completed(job_board* board, uint32_t target)
+{
+    uint32_t completed;
+    __atomic_store_n(&board->target, target, __ATOMIC_SEQ_CST);
+    while((int32_t)((completed = __atomic_load_n(&board->completed, __ATOMIC_SEQ_CST)) - target) < 0)
+        futex_wait(&board->completed, completed);
+}
+
+/**
+ * Persistent mode: n workers are forked once and do jobs estimates of iterations points each.
+ * Jobs are posted as soon as there is room on the board, results are read once a job is completed.
+ */
+void pool_work(int n, int jobs, int iterations)
+{
+    job_board* board;
+    if((board = mmap(NULL, sizeof(job_board), PROT_WRITE | PROT_READ, MAP_SHARED | MAP_ANONYMOUS, -1, 0))==MAP_FAILED)
+        ERR("mmap");
+    memset(board, 0, sizeof(job_board));
+    for(int i = 0; i<n;i++)
+    {
+        pid_t pid;
+        if((pid = fork())==-1)
+            ERR("fork");
+        if(pid == 0)
+            pool_worker(board);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t hits = 0;
+    uint32_t read = 0;
+    uint32_t posted = 0;
+    while(read < (uint32_t)jobs)
+    {
+        // post as many jobs as fit, then collect the oldest results to make room
+        while(posted < (uint32_t)jobs && posted - read < BOARD_SIZE)
+        {
+            job* j = &board->jobs[posted % BOARD_SIZE];
+            j->iterations = iterations;
+            j->seed = posted * 2654435761u + getpid();
+            posted++;
+        }
+        __atomic_store_n(&board->submitted, posted, __ATOMIC_RELEASE);
+        futex_wake(&board->submitted, n);
+        while(read < posted && __atomic_load_n(&board->jobs[read % BOARD_SIZE].done, __ATOMIC_ACQUIRE) == read + 1)
+            hits += board->jobs[read++ % BOARD_SIZE].hits;
+        if(read == posted)
+            continue;
+        // the oldest job is still running: sleep until half the board is completed, or at least one more job
+        uint32_t target = read + BOARD_SIZE / 2 < posted ? read + BOARD_SIZE / 2 : posted;
+        uint32_t completed = __atomic_load_n(&board->completed, __ATOMIC_SEQ_CST);
+        if((int32_t)(target - completed) <= 0)
+            target = completed + 1;
+        wait_completed(board, target);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    __atomic_store_n(&board->stop, 1, __ATOMIC_RELEASE);
+    futex_wake(&board->submitted, n);
+    while(wait(NULL)>0)
+        ;
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("PI is approximately %f\n", 4.0 * hits / ((double)jobs * iterations));
+    printf("%d estimates of %d points in %.3f s: %.0f estimates/s\n", jobs, iterations, seconds, jobs / seconds);
+    if(munmap(board, sizeof(job_board)))
+        ERR("munmap");
+}
+
+// Every writer appends records of 16 to 112 bytes, so their reservations interleave and the file grows under them
+void log_writer(mlog* log, int n, int appends)
+{
+    char buf[128];
+    unsigned int seed = getpid();
+    for(int i = 0; i<appends;i++)
+    {
+        int length = 16 + rand_r(&seed) % 97;
+        memset(buf, 'a' + n % 26, length);
+        memcpy(buf, &i, sizeof(i));
+        log_append(log, buf, length);
+    }
+    log_close(log);
+    exit(EXIT_SUCCESS);
+}
+
+void log_bench(int n, int appends)
+{
+    mlog log;
+    if(unlink(LOG_FILE) == -1 && errno != ENOENT)
+        ERR("unlink");
+    log_open(&log, LOG_FILE);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int i = 0; i<n;i++)
+    {
+        pid_t pid;
+        if((pid = fork())==-1)
+            ERR("fork");
+        if(pid == 0)
+            log_writer(&log, i, appends);
+    }
+    while(wait(NULL)>0)
+        ;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    uint64_t offset = 0, records = 0, bytes = 0;
+    log_record* record;
+    while((record = log_next(&log, &offset)))
+    {
+        if(!record->ready)
+            ERR("log_next");
+        records++;
+        bytes += record->length;
+    }
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%lu records, %lu bytes read back, file is %ld bytes\n", records, bytes, (long)log_file_size(&log));
+    printf("%d writers, %d appends each in %.3f s: %.0f appends/s, %.1f MB/s\n", n, appends, seconds,
+           records / seconds, bytes / seconds / 1e6);
+    if(records != (uint64_t)n * appends)
+    {
+        fprintf(stderr, "Expected %lu records\n", (uint64_t)n * appends);
+        exit(EXIT_FAILURE);
+    }
+    log_close(&log);
+}
+
 int main(int argc, char** argv)
 {
-    if(argc!=2)
+    if(argc<2 || argc>4)
         usage(argv[0]);
     int n = atoi(argv[1]);
     if(n<=0 || n>30)
         usage(argv[0]);
+    if(argc==4 && strcmp(argv[2], "log")==0)
+    {
+        int appends = atoi(argv[3]);
+        if(appends<=0)
+            usage(argv[0]);
+        log_bench(n, appends);
+        return EXIT_SUCCESS;
+    }
+    if(argc>2)
+    {
+        int jobs = atoi(argv[2]);
+        int iterations = argc>3 ? atoi(argv[3]) : ITERATIONS;
+        if(jobs<=0 || iterations<=0)
+            usage(argv[0]);
+        pool_work(n, jobs, iterations);
+        return EXIT_SUCCESS;
+    }
+
+    //every run starts a new log, the children do not need to know in advance how much they will write
+    mlog log;
+    if(unlink(LOG_FILE) == -1 && errno != ENOENT)
+        ERR("unlink");
+    log_open(&log, LOG_FILE);
 
-    int log_fd;
-    if((log_fd = open("./log.txt", O_CREAT | O_RDWR | O_TRUNC, 0666))==-1)
-        ERR("open");
-    if(ftruncate(log_fd, n*NUM)==-1)
-        ERR("ftruncate");
-    //Without it the log.txt file would be size 0, because it’s opened with the O_TRUNC flag, 
-    //which causes the function to remove the file’s contents. Otherwise, if the flag wouldn’t 
-    //have been added, the size would have been dependent on the earlier contents, which would have been unpredictable.
-
-    char* log;
-    if((log = (char*)mmap(NULL, n*NUM, PROT_WRITE | PROT_READ, MAP_SHARED, log_fd, 0))==MAP_FAILED)
-        ERR("mmap");
-    
     float* data;
     if((data = (float*)mmap(NULL, n*sizeof(float), PROT_WRITE | PROT_READ, MAP_SHARED | MAP_ANONYMOUS, -1,0))==MAP_FAILED)
         ERR("mmap");
 
-    create_children(n, data, log);
+    create_children(n, data, &log);
     parent_work(n, data);
 
     if(munmap(data, n*sizeof(float)))
         ERR("munmap");
-    if(msync(log, n*NUM, MS_SYNC))
-        ERR("msync");
-    if(munmap(log, n*NUM))
-        ERR("munmap");
-    
+    log_close(&log);
+
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,235 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define ERR(source) \
+    (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
+#define MAX_N 16384
+
+/*
+ * Shared segment of the treasure board, named /<server pid>-board.
+ * Clients take cells either under the mutex or with an atomic exchange.
+ * Every take is bracketed by claims_started and claims_finished, so the server
+ * can copy the board without the mutex and tell whether a claim ran during the copy.
+ *
+ * The header is followed by two bitsets and the cells:
+ * bit i of cell_bits is set while cell i holds treasure, bit j of word_bits while word j
+ * of cell_bits is not zero. Clients can pick among the remaining treasure by scanning
+ * word_bits instead of probing empty cells, even on a 16k x 16k board that is almost drained.
+ */
+typedef struct
+{
+    pthread_mutex_t mutex;
+    int n;
+    uint32_t claims_started;
+    uint32_t claims_finished;
+    uint64_t remaining;  //cells with treasure
+    uint64_t cell_words;
+    uint64_t summary_words;
+    uint64_t data[];
+}board_shm;
+
+uint64_t words_for(uint64_t bits)
+{
+    return (bits + 63) / 64;
+}
+
+size_t board_size(int n)
+{
+    uint64_t cells = (uint64_t)n * n;
+    return sizeof(board_shm) + 8 * (words_for(cells) + words_for(words_for(cells))) + cells;
+}
+
+uint64_t* cell_bits(board_shm* shm)
+{
+    return shm->data;
+}
+
+uint64_t* word_bits(board_shm* shm)
+{
+    return shm->data + shm->cell_words;
+}
+
+char* board_cells(board_shm* shm)
+{
+    return (char*)(shm->data + shm->cell_words + shm->summary_words);
+}
+
+/**
+ * Maps size bytes of the segment. With huge set the kernel is asked to back it with
+ * transparent huge pages, which works for shared memory when
+ * /sys/kernel/mm/transparent_hugepage/shmem_enabled is advise or always.
+ */
+board_shm* board_map(int fd, size_t size, int huge)
+{
+    board_shm* shm;
+    if((shm = (board_shm*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0))==MAP_FAILED)
+        ERR("mmap");
+    if(huge && madvise(shm, size, MADV_HUGEPAGE))
+        perror("madvise");
+    return shm;
+}
+
+void board_lock(board_shm* shm)
+{
+    int error;
+    if((error = pthread_mutex_lock(&shm->mutex))!=0)
+    {
+        if(error == EOWNERDEAD)
+        {
+            pthread_mutex_consistent(&shm->mutex);
+        }
+        else
+            ERR("pthread_mutex_lock");
+    }
+}
+
+// Fills every cell of a fresh segment with 1 to 9 points and sets up the mutex and the index
+void board_init(board_shm* shm, int n)
+{
+    uint64_t cells = (uint64_t)n * n;
+    shm->n = n;
+    shm->remaining = cells;
+    shm->cell_words = words_for(cells);
+    shm->summary_words = words_for(shm->cell_words);
+    char* board = board_cells(shm);
+    for(uint64_t i = 0; i<cells;i++)
+        board[i] = 1 + rand()%9;
+    memset(cell_bits(shm), 0xff, 8 * shm->cell_words);
+    memset(word_bits(shm), 0xff, 8 * shm->summary_words);
+    if(cells % 64)
+        cell_bits(shm)[shm->cell_words - 1] = (1ULL << cells % 64) - 1;
+    if(shm->cell_words % 64)
+        word_bits(shm)[shm->summary_words - 1] = (1ULL << shm->cell_words % 64) - 1;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shm->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+/**
+ * Clears the bit of a cell that was just emptied.
+ * The summary bit goes when the last bit of its word does, and comes back if put_cell
+ * refilled the word in the meantime, so a word with treasure never stays hidden.
+ */
+void clear_cell_bit(board_shm* shm, uint64_t i)
+{
+    uint64_t mask = 1ULL << i % 64;
+    if(__atomic_fetch_and(&cell_bits(shm)[i / 64], ~mask, __ATOMIC_SEQ_CST) & ~mask)
+        return;
+    uint64_t* summary = &word_bits(shm)[i / 64 / 64];
+    uint64_t summary_mask = 1ULL << i / 64 % 64;
+    __atomic_fetch_and(summary, ~summary_mask, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&cell_bits(shm)[i / 64], __ATOMIC_SEQ_CST))
+        __atomic_fetch_or(summary, summary_mask, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Takes whatever lies on cell i and leaves it empty.
+ * Exchanging the cell with 0 reads and clears it in one step, so two clients can never both collect it.
+ * @return Points found, 0 if the cell was already empty.
+ */
+int take_cell(board_shm* shm, uint64_t i)
+{
+    __atomic_fetch_add(&shm->claims_started, 1, __ATOMIC_SEQ_CST);
+    int num = __atomic_exchange_n(&board_cells(shm)[i], 0, __ATOMIC_SEQ_CST);
+    if(num)
+    {
+        clear_cell_bit(shm, i);
+        __atomic_fetch_sub(&shm->remaining, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&shm->claims_finished, 1, __ATOMIC_RELEASE);
+    return num;
+}
+
+// Puts num points on cell i if it is empty
+void put_cell(board_shm* shm, uint64_t i, int num)
+{
+    char empty = 0;
+    if(!__atomic_compare_exchange_n(&board_cells(shm)[i], &empty, num, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return;
+    __atomic_fetch_add(&shm->remaining, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_or(&cell_bits(shm)[i / 64], 1ULL << i % 64, __ATOMIC_SEQ_CST);
+    __atomic_fetch_or(&word_bits(shm)[i / 64 / 64], 1ULL << i / 64 % 64, __ATOMIC_SEQ_CST);
+}
+
+// splitmix64, rand_r is too short to reach every cell of a large board
+uint64_t next_random(uint64_t* state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Position of a random set bit of a non zero word
+int random_bit(uint64_t word, uint64_t* state)
+{
+    for(int k = next_random(state) % __builtin_popcountll(word); k>0; k--)
+        word &= word - 1;
+    return __builtin_ctzll(word);
+}
+
+/**
+ * Picks a cell that holds treasure: the summary is scanned from a random word for a non empty word
+ * of cell bits, then a random set bit of that word is taken. Another client may empty the cell
+ * before it is taken, the caller just samples again.
+ * @return 1 and the cell in *cell, 0 if no treasure is left.
+ */
+int sample_cell(board_shm* shm, uint64_t* state, uint64_t* cell)
+{
+    uint64_t* summary = word_bits(shm);
+    uint64_t* bits = cell_bits(shm);
+    uint64_t start = next_random(state) % shm->summary_words;
+    for(uint64_t k = 0; k<shm->summary_words;k++)
+    {
+        uint64_t s = (start + k) % shm->summary_words;
+        uint64_t word = __atomic_load_n(&summary[s], __ATOMIC_ACQUIRE);
+        while(word)
+        {
+            int b = random_bit(word, state);
+            uint64_t w = s * 64 + b;
+            uint64_t cells = __atomic_load_n(&bits[w], __ATOMIC_ACQUIRE);
+            if(cells)
+            {
+                *cell = w * 64 + random_bit(cells, state);
+                return 1;
+            }
+            word &= ~(1ULL << b);  //emptied since the summary was read
+        }
+    }
+    return 0;
+}
+
+/**
+ * Copies the board into copy without taking the mutex.
+ * The copy is retried while a claim is in flight or one started during it.
+ * @return Number of retries, -1 if every attempt saw a claim and the last copy may mix two moments.
+ */
+int board_snapshot(board_shm* shm, char* copy, int attempts)
+{
+    size_t cells = (size_t)shm->n * shm->n;
+    for(int i = 0; i<attempts;i++)
+    {
+        uint32_t finished = __atomic_load_n(&shm->claims_finished, __ATOMIC_ACQUIRE);
+        uint32_t started = __atomic_load_n(&shm->claims_started, __ATOMIC_SEQ_CST);
+        if(started != finished)
+            continue;
+        memcpy(copy, board_cells(shm), cells);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&shm->claims_started, __ATOMIC_SEQ_CST) == started)
+            return i;
+    }
+    memcpy(copy, board_cells(shm), cells);
+    return -1;
+}
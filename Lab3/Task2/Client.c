@@ -1,95 +1,269 @@
 #define _GNU_SOURCE
 
-#include <errno.h>
-#include <fcntl.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/mman.h>
 #include <sys/wait.h>
-#include <unistd.h>
+#include <time.h>
 
-#define ERR(source) \
-    (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
-#define SHM_SIZE 1024
+#include "Board.h"
+
+#define MAX_CLIENTS 64
+#define BENCH_MS 200 //length of one bench step
+#define BENCH_N 100
+#define DRAIN_N 1024
+#define CACHE_LINE 64
+
+// Per client results of the load generator, one cache line each so the counters do not bounce between clients
+typedef struct
+{
+    uint64_t probes;
+    uint64_t claims;
+    uint64_t points;
+}__attribute__((aligned(CACHE_LINE))) bench_slot_t;
+
+typedef struct
+{
+    int start;  //set once the last client is forked, so no claim falls outside the measured window
+    int stop;
+    bench_slot_t slots[MAX_CLIENTS];
+}bench_t;
 
 void usage(char* pname)
 {
-    fprintf(stderr, "USAGE: %s\n", pname);
+    fprintf(stderr, "USAGE: %s server_pid [lockfree] [indexed]\n", pname);
+    fprintf(stderr, "       %s bench [n]\n", pname);
+    fprintf(stderr, "       %s drain [n]\n", pname);
+    fprintf(stderr, "lockfree - claim cells with an atomic exchange instead of taking the board mutex\n");
+    fprintf(stderr, "indexed - search only cells the treasure index still lists, the game ends when the board is empty\n");
+    fprintf(stderr, "bench - claims/s of 1 to %d clients on a private n x n board (default: %d), with and without the mutex\n", MAX_CLIENTS, BENCH_N);
+    fprintf(stderr, "drain - probes per find while a private n x n board (default: %d) is emptied, blind and indexed\n", DRAIN_N);
     exit(EXIT_FAILURE);
 }
 
-int main(int argc, char** argv)
+void play(board_shm* b, int lockfree, int indexed)
 {
-    if(argc!=2)
-        usage(argv[0]);
-    
-    int sPid = atoi(argv[1]);
-    printf("%d]n", sPid);
-    if(sPid == 0)
-        usage(argv[0]);
-    
-    srand(getpid());
-
-    int shm_fd;
-    char shm_name[16];
-    snprintf(shm_name, 16, "/%d-board", sPid);
-
-    if((shm_fd = shm_open(shm_name, O_RDWR, 0666))==-1)
-        ERR("open");
-    
-    char* shm_ptr;
-    if((shm_ptr = (char*)mmap(NULL, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0))==MAP_FAILED)
-        ERR("mmap");
-
-    pthread_mutex_t* mutex = (pthread_mutex_t*)shm_ptr;
-    char* sharedN = (shm_ptr + sizeof(pthread_mutex_t));
-    char* board = (shm_ptr + sizeof(pthread_mutex_t) + 1);
-    int n = sharedN[0];
-
-    int score = 0;
-
+    uint64_t state = getpid();
+    int score = 0, probes = 0, finds = 0;
     while(1)
     {
-        int error;
-        if((error = pthread_mutex_lock(mutex))!=0)
-        {
-            if(error == EOWNERDEAD)
-            {
-                pthread_mutex_consistent(mutex);
-            }
-            else
-                ERR("pthread_mutex_lock");
-        }
+        if(!lockfree)
+            board_lock(b);
         int d = 1 + rand()%9;
         if(d == 1)
         {
             printf("Oops...\n");
         }
 
-        int x = rand()%n;
-        int y = rand()%n;
-        printf("Trying to search field (%d, %d)\n", x, y);
+        uint64_t i = (uint64_t)(rand()%b->n)*b->n + rand()%b->n;
+        if(indexed && !sample_cell(b, &state, &i))
+        {
+            if(!lockfree)
+                pthread_mutex_unlock(&b->mutex);
+            printf("GAME OVER: no treasure left, score %d\n", score);
+            break;
+        }
+        printf("Trying to search field (%d, %d)\n", (int)(i % b->n), (int)(i / b->n));
 
-        int num = board[n*y + x];
-        if(num==0)
+        int num = take_cell(b, i);
+        probes++;
+        if(!lockfree)
+            pthread_mutex_unlock(&b->mutex);
+        if(num==0 && !indexed)
         {
             printf("GAME OVER: score %d\n", score);
-            pthread_mutex_unlock(mutex);
             break;
         }
+        if(num==0)
+            printf("someone was faster\n");
         else
         {
             printf("found %d points\n", num);
             score += num;
-            board[n*y + x] = 0;
+            finds++;
         }
 
-        pthread_mutex_unlock(mutex);
         struct timespec t = {1,0};
         nanosleep(&t, &t);
     }
+    printf("%d probes, %.2f per find\n", probes, finds ? (double)probes / finds : 0.0);
+}
+
+/**
+ * Claims random cells as fast as it can until the parent sets stop.
+ * An empty cell is refilled, so the board never runs dry and a claim costs the same all through the step.
+ * In the mutex mode the refill happens under the same lock as the claim, so every board write is serialized.
+ */
+void bench_client(board_shm* b, bench_t* bench, int id, int lockfree)
+{
+    uint64_t state = getpid();
+    bench_slot_t* slot = &bench->slots[id];
+    uint64_t probes = 0, claims = 0, points = 0;
+    while(!__atomic_load_n(&bench->start, __ATOMIC_ACQUIRE))
+        sched_yield();
+    while(!__atomic_load_n(&bench->stop, __ATOMIC_RELAXED))
+    {
+        uint64_t i = next_random(&state) % ((uint64_t)b->n*b->n);
+        if(!lockfree)
+            board_lock(b);
+        int num = take_cell(b, i);
+        probes++;
+        if(num==0)
+            put_cell(b, i, 1 + probes%9);
+        if(!lockfree)
+            pthread_mutex_unlock(&b->mutex);
+        if(num)
+        {
+            claims++;
+            points += num;
+        }
+    }
+    slot->probes = probes;
+    slot->claims = claims;
+    slot->points = points;
+    exit(EXIT_SUCCESS);
+}
+
+void bench_step(board_shm* b, bench_t* bench, int clients, int lockfree)
+{
+    memset(bench, 0, sizeof(bench_t));
+    board_init(b, b->n);
+    fflush(stdout);
+    for(int i = 0; i<clients;i++)
+    {
+        pid_t pid;
+        if((pid = fork())==-1)
+            ERR("fork");
+        if(pid == 0)
+            bench_client(b, bench, i, lockfree);
+    }
+    struct timespec start, end, t = {0, BENCH_MS * 1000000L};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    __atomic_store_n(&bench->start, 1, __ATOMIC_RELEASE);
+    nanosleep(&t, NULL);
+    __atomic_store_n(&bench->stop, 1, __ATOMIC_RELAXED);
+    while(wait(NULL)>0)
+        ;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    uint64_t probes = 0, claims = 0;
+    for(int i = 0; i<clients;i++)
+    {
+        probes += bench->slots[i].probes;
+        claims += bench->slots[i].claims;
+    }
+    printf("%-9s %3d clients: %12.0f claims/s %12.0f probes/s\n", lockfree ? "lockfree" : "mutex", clients, claims / seconds,
+           probes / seconds);
+}
+
+board_shm* private_board(int n)
+{
+    board_shm* b;
+    if((b = (board_shm*)mmap(NULL, board_size(n), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0))==MAP_FAILED)
+        ERR("mmap");
+    b->n = n;
+    return b;
+}
+
+void bench(int n)
+{
+    board_shm* b = private_board(n);
+    bench_t* bench;
+    if((bench = (bench_t*)mmap(NULL, sizeof(bench_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0))==MAP_FAILED)
+        ERR("mmap");
+
+    for(int lockfree = 0; lockfree<2;lockfree++)
+    {
+        for(int clients = 1; clients<=MAX_CLIENTS;clients*=2)
+            bench_step(b, bench, clients, lockfree);
+    }
+    pthread_mutex_destroy(&b->mutex);
+    munmap(bench, sizeof(bench_t));
+    munmap(b, board_size(n));
+}
+
+/**
+ * Empties a private board with one client, picking cells blindly or from the index,
+ * and prints the probes per find of every tenth of the board.
+ */
+void drain(board_shm* b, int indexed)
+{
+    uint64_t state = getpid();
+    board_init(b, b->n);
+    uint64_t cells = (uint64_t)b->n * b->n, probes = 0, finds = 0, total = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int tenth = 9; tenth>=0; tenth--)
+    {
+        while(b->remaining > cells * tenth / 10)
+        {
+            uint64_t i = next_random(&state) % cells;
+            if(indexed && !sample_cell(b, &state, &i))
+                break;
+            probes++;
+            if(take_cell(b, i))
+                finds++;
+        }
+        printf("%-7s %3d%% left: %10.2f probes/find\n", indexed ? "indexed" : "blind", tenth * 10,
+               finds ? (double)probes / finds : 0.0);
+        total += probes;
+        probes = finds = 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%-7s drained %lu cells with %lu probes in %.3f s\n", indexed ? "indexed" : "blind", cells, total,
+           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+int main(int argc, char** argv)
+{
+    if(argc<2 || argc>4)
+        usage(argv[0]);
+    srand(getpid());
+
+    if(strcmp(argv[1], "bench")==0 || strcmp(argv[1], "drain")==0)
+    {
+        int n = argc==3 ? atoi(argv[2]) : argv[1][0]=='b' ? BENCH_N : DRAIN_N;
+        if(argc>3 || n<1 || n>MAX_N)
+            usage(argv[0]);
+        if(argv[1][0]=='b')
+            bench(n);
+        else
+        {
+            board_shm* b = private_board(n);
+            drain(b, 0);
+            drain(b, 1);
+            munmap(b, board_size(n));
+        }
+        return EXIT_SUCCESS;
+    }
+
+    int sPid = atoi(argv[1]);
+    if(sPid == 0)
+        usage(argv[0]);
+    int lockfree = 0, indexed = 0;
+    for(int i = 2; i<argc;i++)
+    {
+        if(strcmp(argv[i], "lockfree")==0)
+            lockfree = 1;
+        else if(strcmp(argv[i], "indexed")==0)
+            indexed = 1;
+        else
+            usage(argv[0]);
+    }
+
+    int shm_fd;
+    char shm_name[16];
+    snprintf(shm_name, 16, "/%d-board", sPid);
+
+    if((shm_fd = shm_open(shm_name, O_RDWR, 0666))==-1)
+        ERR("open");
+
+    //the size of the segment follows from n, which is only known once the header is mapped
+    board_shm* b = board_map(shm_fd, sizeof(board_shm), 0);
+    size_t size = board_size(b->n);
+    munmap(b, sizeof(board_shm));
+    b = board_map(shm_fd, size, 0);
+
+    play(b, lockfree, indexed);
+
     close(shm_fd);
-    munmap(shm_ptr, SHM_SIZE);
+    munmap(b, size);
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
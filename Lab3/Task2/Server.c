@@ -1,20 +1,12 @@
 #define _GNU_SOURCE
 
-#include <errno.h>
-#include <fcntl.h>
-#include <pthread.h>
-#include <signal.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <unistd.h>
 
-#define ERR(source) \
-    (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
-#define SHM_SIZE 1024
+#include "Board.h"
+
+#define SNAPSHOT_ATTEMPTS 100
+#define PRINT_N 100 //larger boards are summed up instead of printed
 
 typedef struct 
 {
@@ -25,7 +17,10 @@ typedef struct
 
 void usage(char* pname)
 {
-    fprintf(stderr, "USAGE: %s\n", pname);
+    fprintf(stderr, "USAGE: %s n [huge]\n", pname);
+    fprintf(stderr, "n - side of the board, 3 <= n <= %d\n", MAX_N);
+    fprintf(stderr, "huge - back the board with transparent huge pages\n");
+    exit(EXIT_FAILURE);
 }
 
 void* signalHandler(void* args)
@@ -47,12 +42,14 @@ void* signalHandler(void* args)
 
 int main(int argc, char** argv)
 {
-    if(argc!=2)
+    if(argc<2 || argc>3 || (argc==3 && strcmp(argv[2], "huge")))
         usage(argv[0]);
 
     int n = atoi(argv[1]);
-    if(n<3 || n>100)
+    if(n<3 || n>MAX_N)
         usage(argv[0]);
+    int huge = argc==3;
+    size_t size = board_size(n);
     
     pid_t pid = getpid();
     srand(getpid());
@@ -65,31 +62,14 @@ int main(int argc, char** argv)
 
     if((shm_fd = shm_open(shm_name, O_CREAT | O_EXCL | O_RDWR, 0666))==-1)
         ERR("shm_open");
-    if(ftruncate(shm_fd, SHM_SIZE)==-1)
+    if(ftruncate(shm_fd, size)==-1)
         ERR("ftruncate");
-    
-    char* shm_ptr;
-    if((shm_ptr = (char*)mmap(NULL, SHM_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED,shm_fd, 0))==MAP_FAILED)
-        ERR("mmap");
-    
-    pthread_mutex_t* mutex = (pthread_mutex_t*)shm_ptr;
-    char* Shared_N = (shm_ptr + sizeof(pthread_mutex_t));
-    char* board = (shm_ptr + sizeof(pthread_mutex_t) + 1);
-    Shared_N[0] = n;
 
-    for(int i = 0; i<n;i++)
-    {
-        for(int j = 0; j<n;j++)
-        {
-            board[i*n + j] = 1 + rand()%9;
-        }
-    }
-
-    pthread_mutexattr_t attr;
-    pthread_mutexattr_init(&attr);
-    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
-    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
-    pthread_mutex_init(mutex, &attr);
+    board_shm* shm = board_map(shm_fd, size, huge);
+    board_init(shm, n);
+    char* copy = NULL;
+    if(n<=PRINT_N && (copy = malloc(n*n))==NULL)
+        ERR("malloc");
 
     signalhandling_args_t signalhandling_args = {1,PTHREAD_MUTEX_INITIALIZER};
     sigemptyset(&signalhandling_args.newmask);
@@ -110,37 +90,36 @@ int main(int argc, char** argv)
         }
         pthread_mutex_unlock(&signalhandling_args.mutex);
 
-        int error;
-        if((error = pthread_mutex_lock(mutex))!=0)
+        if(!copy)
         {
-            if(error == EOWNERDEAD)
-            {
-                pthread_mutex_consistent(mutex);
-            }
-            else
-                ERR("pthread_mutex_lock");
+            uint64_t remaining = __atomic_load_n(&shm->remaining, __ATOMIC_RELAXED);
+            printf("%lu of %lu cells hold treasure\n", remaining, (uint64_t)n*n);
+            struct timespec t = {3,0};
+            nanosleep(&t, &t);
+            continue;
         }
+        //clients never wait for the terminal, the board is printed from a private copy
+        if(board_snapshot(shm, copy, SNAPSHOT_ATTEMPTS)==-1)
+            printf("Board changed during every copy, it may show a claim half done\n");
         for(int i = 0; i<n;i++)
         {
             for(int j = 0 ; j<n;j++)
             {
-                printf("%d", board[i*n+j]);
+                printf("%d", copy[i*n+j]);
             }
             printf("\n");
         }
         printf("\n");
-        pthread_mutex_unlock(mutex);
         struct timespec t = {3,0};
         nanosleep(&t, &t);
     }
 
     pthread_join(signaling_thread, NULL);
 
-    pthread_mutexattr_destroy(&attr);
-    pthread_mutex_destroy(mutex);
+    pthread_mutex_destroy(&shm->mutex);
+    free(copy);
 
-    
-    munmap(shm_ptr, SHM_SIZE);
+    munmap(shm, size);
     shm_unlink(shm_name);
 
     return EXIT_SUCCESS;